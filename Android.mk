@@ -9,7 +9,10 @@ endif
 LOCAL_SRC_FILES:= \
     main.c \
     nv_read.c \
+    nv_checksum.c \
     modem_connect.c \
+    modem_state.c \
+    modem_cmd.c \
     modem_load.c \
     modem_control.c \
     xml_parse.c \
@@ -26,7 +29,9 @@ else
 endif
 
 ifeq ($(strip $(USE_SPRD_ORCA_MODEM)), true)
-    LOCAL_SRC_FILES += modem_pcie_control.c
+    LOCAL_SRC_FILES += modem_pcie_control.c \
+                       modem_pcie_bar.c
+    LOCAL_CFLAGS += -DFEATURE_PCIE_BAR_LOAD
 endif
 
 ifeq ($(BOARD_SIMLOCK_AP_READ_EFUSE), true)
@@ -108,13 +113,24 @@ LOCAL_PROPRIETARY_MODULE := true
 include $(BUILD_EXECUTABLE)
 
 
+# libmodemctrl, the client side of modemd
+include $(CLEAR_VARS)
+LOCAL_MODULE := libmodemctrl
+LOCAL_SRC_FILES := modem_ctrl_client.c
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE_TAGS := optional
+LOCAL_PROPRIETARY_MODULE := true
+include $(BUILD_SHARED_LIBRARY)
+
 ifeq ($(strip $(USE_SPRD_ORCA_MODEM)), true)
 # modem_control debug tool
 include $(CLEAR_VARS)
 LOCAL_MODULE := modem_ctrl_dbg
 LOCAL_PROPRIETARY_MODULE := true
 LOCAL_SRC_FILES := modem_ctrl_dbg.c \
-                   modem_io_control.c
+                   modem_io_control.c \
+                   modem_pcie_bar.c
 
 ifeq ($(strip $(BOARD_EXTERNAL_MODEM)), true)
   LOCAL_CFLAGS += -DFEATURE_EXTERNAL_MODEM
@@ -123,8 +139,20 @@ endif
 LOCAL_SHARED_LIBRARIES := libc \
                           libcutils \
                           liblog \
+                          libmodemctrl \
                           libutils
 include $(BUILD_EXECUTABLE)
 
 CUSTOM_MODULES += modem_ctrl_dbg
 endif
+
+# nv checksum and read benchmark, runs on host
+include $(CLEAR_VARS)
+LOCAL_MODULE := modem_nv_bench
+LOCAL_SRC_FILES := nv_bench.c \
+                   nv_read.c \
+                   nv_checksum.c
+LOCAL_STATIC_LIBRARIES := libcutils \
+                          liblog
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
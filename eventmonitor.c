@@ -13,43 +13,201 @@
 #include <sys/socket.h>
 #include <poll.h>
 #include <pthread.h>
+#include <time.h>
 #include <cutils/uevent.h>
 
 #include "modem_control.h"
 #include "eventmonitor.h"
 
 #define UEVENT_MSG_LEN 4096
+/* the handlers run on these, one subsystem on one worker at a time */
+#define UEVENT_WORKER_NUM 2
+/* events queued for a subsystem, a new one is dropped above it */
+#define UEVENT_QUEUE_MAX 32
+/*
+ * preallocated events: the queues of two busy subsystems, the events
+ * the workers run and the one being received.
+ */
+#define UEVENT_POOL_SIZE (2 * UEVENT_QUEUE_MAX + UEVENT_WORKER_NUM + 1)
+/* a handler running longer is logged */
+#define UEVENT_SLOW_US (500 * 1000)
 
 static void parse_event(const char *msg, BaseUEventInfo *Info);
 
+/* an event of the pool, received into msg, info points into it */
+struct uevent_job {
+    struct uevent_job *next;
+    uint64_t time_us;     /* CLOCK_MONOTONIC of the receive */
+    BaseUEventInfo info;
+    char msg[UEVENT_MSG_LEN + 2];
+};
+
 struct event_client {
     char *subsystem;
+    uint32_t hash;        /* of subsystem */
     void (*handler)(BaseUEventInfo *, void *);
     void *data;
+    /* the events of the subsystem, handled in order */
+    struct uevent_job *head;
+    struct uevent_job *tail;
+    int depth;
+    bool busy;            /* a worker runs its handler */
+    bool ready;           /* in s_readyClients */
+    /* stats */
+    int max_depth;
+    unsigned int handled;
+    unsigned int dropped;
+    uint64_t wait_us;
+    uint64_t max_wait_us;
+    uint64_t run_us;
+    uint64_t max_run_us;
 };
 
 #define MAX_EVENT_CLIENT 10
+/* slots of the subsystem hash, a power of 2 above MAX_EVENT_CLIENT */
+#define UEVENT_HASH_SIZE 32
 
 static struct event_client g_event_client[MAX_EVENT_CLIENT];
+/* client index + 1 by the hash of the subsystem, 0 if empty */
+static int s_subsystemHash[UEVENT_HASH_SIZE];
+static struct uevent_job s_jobPool[UEVENT_POOL_SIZE];
+static struct uevent_job *s_freeJobs = NULL;
+static int s_freeJobNum = 0;
+static unsigned int s_poolDropped = 0;
+static pthread_mutex_t s_eventMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_eventCond = PTHREAD_COND_INITIALIZER;
+/* clients with queued events and no running handler */
+static int s_readyClients[MAX_EVENT_CLIENT];
+static int s_readyHead = 0;
+static int s_readyNum = 0;
+static int s_workerNum = 0;
+/* received into when the pool is empty, only by the monitor thread */
+static char s_scratchMsg[UEVENT_MSG_LEN + 2];
+
+static uint64_t uevent_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* with s_eventMutex held */
+static struct uevent_job *uevent_job_get(void)
+{
+  struct uevent_job *job = s_freeJobs;
+
+  if (job) {
+    s_freeJobs = job->next;
+    s_freeJobNum--;
+  }
+  return job;
+}
+
+/* with s_eventMutex held */
+static void uevent_job_put(struct uevent_job *job)
+{
+  job->next = s_freeJobs;
+  s_freeJobs = job;
+  s_freeJobNum++;
+}
+
+static void uevent_pool_init(void)
+{
+  int i;
+
+  pthread_mutex_lock(&s_eventMutex);
+  for (i = 0; i < UEVENT_POOL_SIZE; i++)
+    uevent_job_put(&s_jobPool[i]);
+  pthread_mutex_unlock(&s_eventMutex);
+}
+
+/* fnv-1a */
+static uint32_t uevent_hash(const char *str)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* with s_eventMutex held, after a client is added or removed */
+static void uevent_hash_rebuild(void)
+{
+  uint32_t slot;
+  int i;
+
+  memset(s_subsystemHash, 0, sizeof(s_subsystemHash));
+  for (i = 0; i < MAX_EVENT_CLIENT; i++) {
+    if (!g_event_client[i].subsystem)
+      continue;
+    slot = g_event_client[i].hash & (UEVENT_HASH_SIZE - 1);
+    while (s_subsystemHash[slot])
+      slot = (slot + 1) & (UEVENT_HASH_SIZE - 1);
+    s_subsystemHash[slot] = i + 1;
+  }
+}
+
+/* the client of the subsystem, with s_eventMutex held */
+static int uevent_find_client(const char *subsystem)
+{
+  uint32_t hash = uevent_hash(subsystem);
+  uint32_t slot = hash & (UEVENT_HASH_SIZE - 1);
+  int i;
+
+  while (s_subsystemHash[slot]) {
+    i = s_subsystemHash[slot] - 1;
+    if (g_event_client[i].hash == hash &&
+        0 == strcmp(g_event_client[i].subsystem, subsystem))
+      return i;
+    slot = (slot + 1) & (UEVENT_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+/* put the queued events of a client back, with s_eventMutex held */
+static void uevent_client_flush(struct event_client *client)
+{
+  struct uevent_job *job;
+
+  while (client->head) {
+    job = client->head;
+    client->head = job->next;
+    uevent_job_put(job);
+  }
+  client->tail = NULL;
+  client->depth = 0;
+}
 
 int modem_event_register(char *subsystem,
     void (*handler)(BaseUEventInfo *, void *), void *data)
 {
   int i;
 
+  pthread_mutex_lock(&s_eventMutex);
   for(i = 0; i < MAX_EVENT_CLIENT; i++) {
-    if (!g_event_client[i].handler)
+    if (!g_event_client[i].handler && !g_event_client[i].busy
+        && !g_event_client[i].ready)
       break;
   }
 
   MODEM_LOGIF("event register: subsystem = %s, i = %d", subsystem, i);
 
-  if (i == MAX_EVENT_CLIENT)
+  if (i == MAX_EVENT_CLIENT) {
+    pthread_mutex_unlock(&s_eventMutex);
     return -1;
+  }
 
+  memset(&g_event_client[i], 0, sizeof(g_event_client[i]));
   g_event_client[i].handler = handler;
   g_event_client[i].data = data;
   g_event_client[i].subsystem = subsystem;
+  g_event_client[i].hash = uevent_hash(subsystem);
+  uevent_hash_rebuild();
+  pthread_mutex_unlock(&s_eventMutex);
 
   return 0;
 }
@@ -60,83 +218,269 @@ void modem_event_unregister(char *subsystem)
 
   MODEM_LOGIF("event unregister: subsystem = %s", subsystem);
 
+  pthread_mutex_lock(&s_eventMutex);
   for (i = 0; i < MAX_EVENT_CLIENT; i++) {
       if (g_event_client[i].subsystem &&
           0 == strcmp(g_event_client[i].subsystem, subsystem)) {
         g_event_client[i].subsystem = NULL;
         g_event_client[i].handler = NULL;
         g_event_client[i].data = NULL;
+        uevent_client_flush(&g_event_client[i]);
+        uevent_hash_rebuild();
         break;
       }
   }
+  pthread_mutex_unlock(&s_eventMutex);
+}
+
+/* run the handler of client i on job, then put it back to the pool */
+static void uevent_run(int i, struct uevent_job *job,
+                       void (*handler)(BaseUEventInfo *, void *), void *data)
+{
+  struct event_client *client = &g_event_client[i];
+  uint64_t start_us, end_us;
+
+  start_us = uevent_now_us();
+  handler(&job->info, data);
+  end_us = uevent_now_us();
+  if (end_us - start_us > UEVENT_SLOW_US)
+    MODEM_LOGD("%s: %s handler took %llums", __FUNCTION__,
+               job->info.subsystem,
+               (unsigned long long)(end_us - start_us) / 1000);
+
+  pthread_mutex_lock(&s_eventMutex);
+  client->handled++;
+  client->wait_us += start_us - job->time_us;
+  if (start_us - job->time_us > client->max_wait_us)
+    client->max_wait_us = start_us - job->time_us;
+  client->run_us += end_us - start_us;
+  if (end_us - start_us > client->max_run_us)
+    client->max_run_us = end_us - start_us;
+  uevent_job_put(job);
+  pthread_mutex_unlock(&s_eventMutex);
 }
 
-static void *uevent_handle_thread(void* info)
+/* queue client i to a worker if it has events, with s_eventMutex held */
+static void uevent_client_ready(int i)
+{
+  struct event_client *client = &g_event_client[i];
+
+  if (client->busy || client->ready || client->depth == 0)
+    return;
+
+  client->ready = true;
+  s_readyClients[(s_readyHead + s_readyNum) % MAX_EVENT_CLIENT] = i;
+  s_readyNum++;
+  pthread_cond_signal(&s_eventCond);
+}
+
+static void *uevent_worker(void *param)
 {
-  BaseUEventInfo *pInfo = (BaseUEventInfo *)info;
   void (*handler)(BaseUEventInfo *, void *);
-  void* data;
+  struct event_client *client;
+  struct uevent_job *job;
+  void *data;
+  int i;
+
+  (void)param;
+  pthread_mutex_lock(&s_eventMutex);
+  for (;;) {
+    while (s_readyNum == 0)
+      pthread_cond_wait(&s_eventCond, &s_eventMutex);
+    i = s_readyClients[s_readyHead];
+    s_readyHead = (s_readyHead + 1) % MAX_EVENT_CLIENT;
+    s_readyNum--;
+
+    client = &g_event_client[i];
+    client->ready = false;
+    job = client->head;
+    if (NULL == job || NULL == client->handler)
+      continue;
+    client->head = job->next;
+    if (NULL == client->head)
+      client->tail = NULL;
+    client->depth--;
+    /* the next event of the subsystem waits for this one */
+    client->busy = true;
+    handler = client->handler;
+    data = client->data;
+    pthread_mutex_unlock(&s_eventMutex);
+
+    uevent_run(i, job, handler, data);
+
+    pthread_mutex_lock(&s_eventMutex);
+    client->busy = false;
+    uevent_client_ready(i);
+  }
 
-  MODEM_LOGIF("handle thread!");
+  return NULL;
+}
 
-  handler = g_event_client[pInfo->handle_index].handler;
-  data = g_event_client[pInfo->handle_index].data;
-  handler(pInfo, data);
-  free(pInfo);
+static void uevent_workers_start(void)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+  int i;
 
-  return 0;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < UEVENT_WORKER_NUM; i++) {
+    if (0 != pthread_create(&tid, &attr, uevent_worker, NULL)) {
+      MODEM_LOGE("%s: worker create error!", __FUNCTION__);
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  pthread_mutex_lock(&s_eventMutex);
+  s_workerNum = i;
+  pthread_mutex_unlock(&s_eventMutex);
+  MODEM_LOGD("%s: %d workers", __FUNCTION__, i);
 }
 
-static void modem_event_process(BaseUEventInfo *info)
+/* queue job to its subsystem, 0 if it isn't taken and can be reused */
+static int modem_event_process(struct uevent_job *job)
 {
+  void (*handler)(BaseUEventInfo *, void *);
+  BaseUEventInfo *info = &job->info;
+  struct event_client *client;
+  void *data;
   int i;
-  void (*handler)(BaseUEventInfo *, void *) = NULL;
-  pthread_t thread;
 
   MODEM_LOGIF("event process: subsystem = %s", info->subsystem);
 
-  for (i = 0; i < MAX_EVENT_CLIENT; i++) {
-      if (!g_event_client[i].subsystem)
-        continue;
+  if (!info->subsystem)
+    return 0;
 
-      if (0 == strcmp(g_event_client[i].subsystem, info->subsystem)) {
-        handler = g_event_client[i].handler;
-        break;
-      }
+  pthread_mutex_lock(&s_eventMutex);
+  i = uevent_find_client(info->subsystem);
+  if (i < 0) {
+    pthread_mutex_unlock(&s_eventMutex);
+    MODEM_LOGIF("event process: can't find client!");
+    return 0;
+  }
+  client = &g_event_client[i];
+  job->next = NULL;
+  job->time_us = uevent_now_us();
+  info->handle_index = i;
+
+  if (s_workerNum == 0) {
+    /* no worker, run it here */
+    handler = client->handler;
+    data = client->data;
+    pthread_mutex_unlock(&s_eventMutex);
+    uevent_run(i, job, handler, data);
+    return 1;
+  }
+  if (client->depth >= UEVENT_QUEUE_MAX) {
+    if (client->dropped++ % UEVENT_QUEUE_MAX == 0)
+      MODEM_LOGE("%s: %s queue full, %u dropped", __FUNCTION__,
+                 client->subsystem, client->dropped);
+    pthread_mutex_unlock(&s_eventMutex);
+    return 0;
   }
 
-  if (handler) {
-    info->handle_index = i;
-    if (0 != pthread_create(&thread, NULL, uevent_handle_thread, info)) {
-      MODEM_LOGE(" handle thread create error!\n");
-      free(info);
-    }
+  if (client->tail)
+    client->tail->next = job;
+  else
+    client->head = job;
+  client->tail = job;
+  client->depth++;
+  if (client->depth > client->max_depth)
+    client->max_depth = client->depth;
+  uevent_client_ready(i);
+  pthread_mutex_unlock(&s_eventMutex);
+
+  return 1;
+}
+
+/* the pool is empty, count the event if its subsystem has a client */
+static void uevent_drop(const BaseUEventInfo *info)
+{
+  int i;
+
+  if (!info->subsystem)
+    return;
+
+  pthread_mutex_lock(&s_eventMutex);
+  i = uevent_find_client(info->subsystem);
+  if (i >= 0) {
+    g_event_client[i].dropped++;
+    if (s_poolDropped++ % UEVENT_POOL_SIZE == 0)
+      MODEM_LOGE("%s: no free event, %u dropped", __FUNCTION__,
+                 s_poolDropped);
   }
-  else {
-    MODEM_LOGIF("event process: can't find client!");
-    free(info);
+  pthread_mutex_unlock(&s_eventMutex);
+}
+
+int modem_event_stats(char *buf, int size)
+{
+  struct event_client *client;
+  int i, len = 0;
+
+  buf[0] = '\0';
+  pthread_mutex_lock(&s_eventMutex);
+  len += snprintf(buf + len, size - len, "uevent workers=%d free=%d "
+                  "dropped=%u", s_workerNum, s_freeJobNum, s_poolDropped);
+  for (i = 0; i < MAX_EVENT_CLIENT && len < size; i++) {
+    client = &g_event_client[i];
+    if (!client->subsystem)
+      continue;
+    len += snprintf(buf + len, size - len, "; %s depth=%d max=%d "
+                    "handled=%u dropped=%u wait avg=%lluus max=%lluus "
+                    "run avg=%lluus max=%lluus", client->subsystem,
+                    client->depth, client->max_depth, client->handled,
+                    client->dropped,
+                    (unsigned long long)(client->handled ?
+                        client->wait_us / client->handled : 0),
+                    (unsigned long long)client->max_wait_us,
+                    (unsigned long long)(client->handled ?
+                        client->run_us / client->handled : 0),
+                    (unsigned long long)client->max_run_us);
   }
+  pthread_mutex_unlock(&s_eventMutex);
+
+  return min(len, size - 1);
 }
 
 void modem_event_device_fd(int sock) {
-  char msg[UEVENT_MSG_LEN + 2];
+  struct uevent_job *job = NULL;
+  BaseUEventInfo info;
+  char *msg;
   int n;
-  BaseUEventInfo *info;
 
-  while ((n = uevent_kernel_multicast_recv(sock, msg, UEVENT_MSG_LEN)) > 0) {
+  for (;;) {
+    /* receive into a free event, it's kept for the next one if unwanted */
+    if (!job) {
+      pthread_mutex_lock(&s_eventMutex);
+      job = uevent_job_get();
+      pthread_mutex_unlock(&s_eventMutex);
+    }
+    msg = job ? job->msg : s_scratchMsg;
+
+    n = uevent_kernel_multicast_recv(sock, msg, UEVENT_MSG_LEN);
+    if (n <= 0)
+      break;
     if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
       continue;
 
     msg[n] = '\0';
     msg[n + 1] = '\0';
 
-    info = (BaseUEventInfo *)malloc(sizeof(BaseUEventInfo));
-    if (info) {
-      parse_event(msg, info);
-      modem_event_process(info);
-    } else {
-        MODEM_LOGE("malloc BaseUEventInfo failed!");
+    if (!job) {
+      parse_event(msg, &info);
+      uevent_drop(&info);
+      continue;
     }
+    parse_event(msg, &job->info);
+    if (modem_event_process(job))
+      job = NULL;
+  }
+
+  if (job) {
+    pthread_mutex_lock(&s_eventMutex);
+    uevent_job_put(job);
+    pthread_mutex_unlock(&s_eventMutex);
   }
 }
 
@@ -146,6 +490,9 @@ void *uevent_monitor_thread(void *data)
   int sock = -1;
   int nr;
 
+  uevent_pool_init();
+  uevent_workers_start();
+
   sock = uevent_open_socket(256 * 1024, true);
   if (-1 == sock) {
    MODEM_LOGE("%s: socket init failed !%s, %d\n", __FUNCTION__, strerror(errno), errno);
@@ -165,8 +512,14 @@ void *uevent_monitor_thread(void *data)
   }
 }
 
+/* key is a string literal with the '=' */
+#define UEVENT_KEY(msg, len, key) \
+    ((len) >= sizeof(key) - 1 && !memcmp(msg, key, sizeof(key) - 1))
+
 static void parse_event(const char *msg, BaseUEventInfo *Info)
 {
+    size_t len;
+
     Info->action = NULL;
     Info->path = NULL;
     Info->subsystem = NULL;
@@ -178,34 +531,42 @@ static void parse_event(const char *msg, BaseUEventInfo *Info)
 
     while (*msg) {
         MODEM_LOGIF("uevent %s\n", msg);
-        if (!strncmp(msg, "ACTION=", 7)) {
-            msg += 7;
-            Info->action = msg;
-        } else if (!strncmp(msg, "DEVPATH=", 8)) {
-            msg += 8;
-            Info->path = msg;
-        } else if (!strncmp(msg, "SUBSYSTEM=", 10)) {
-            msg += 10;
-            Info->subsystem = msg;
-        } else if (!strncmp(msg, "FIRMWARE=", 9)) {
-            msg += 9;
-            Info->firmware = msg;
-        } else if (!strncmp(msg, "MAJOR=", 6)) {
-            msg += 6;
-            Info->major = atoi(msg);
-        } else if (!strncmp(msg, "MINOR=", 6)) {
-            msg += 6;
-            Info->minor = atoi(msg);
-        }else if(!strncmp(msg,"MODEM_EVENT=",12)){
-            msg += 12;
-            MODEM_LOGD("uevent %s\n", msg);
-            Info->modem_event = msg;
-        }else if(!strncmp(msg,"MODEM_STAT=",11)){
-            msg += 11;
-            MODEM_LOGD("uevent %s\n", msg);
-            Info->modem_stat =atoi(msg);
+        len = strlen(msg);
+        /* only the keys of the first char are compared */
+        switch (msg[0]) {
+        case 'A':
+            if (UEVENT_KEY(msg, len, "ACTION="))
+                Info->action = msg + 7;
+            break;
+        case 'D':
+            if (UEVENT_KEY(msg, len, "DEVPATH="))
+                Info->path = msg + 8;
+            break;
+        case 'S':
+            if (UEVENT_KEY(msg, len, "SUBSYSTEM="))
+                Info->subsystem = msg + 10;
+            break;
+        case 'F':
+            if (UEVENT_KEY(msg, len, "FIRMWARE="))
+                Info->firmware = msg + 9;
+            break;
+        case 'M':
+            if (UEVENT_KEY(msg, len, "MAJOR=")) {
+                Info->major = atoi(msg + 6);
+            } else if (UEVENT_KEY(msg, len, "MINOR=")) {
+                Info->minor = atoi(msg + 6);
+            } else if (UEVENT_KEY(msg, len, "MODEM_EVENT=")) {
+                MODEM_LOGD("uevent %s\n", msg + 12);
+                Info->modem_event = msg + 12;
+            } else if (UEVENT_KEY(msg, len, "MODEM_STAT=")) {
+                MODEM_LOGD("uevent %s\n", msg + 11);
+                Info->modem_stat = atoi(msg + 11);
+            }
+            break;
+        default:
+            break;
         }
 
-        while(*msg++);
+        msg += len + 1;
     }
 }
@@ -15,6 +15,7 @@
  *
  */
 
+/* the strings point into the event, they're valid during the handler */
 typedef struct BaseUEventInfo_T {
     const char *action;
     const char *path;
@@ -31,4 +32,6 @@ void *uevent_monitor_thread(void* data);
 int  modem_event_register(char *subsystem,
     void (*handler)(BaseUEventInfo *, void *), void *data);
 void modem_event_unregister(char *subsystem);
+/* queue depth and handler latency of the subsystems, the length */
+int modem_event_stats(char *buf, int size);
 #endif
@@ -11,7 +11,9 @@
 #include <cutils/android_filesystem_config.h>
 
 #include "modem_control.h"
+#include "modem_cmd.h"
 #include "modem_connect.h"
+#include "modem_state.h"
 
 #include "eventmonitor.h"
 
@@ -129,6 +131,14 @@ int main(int argc, char *argv[]) {
   }
 #endif
 
+  /* the state page is passed to clients */
+  if (0 != modem_state_init())
+    MODEM_LOGE("modem state page create error!\n");
+
+  /* the commands from the clients to modem control */
+  if (0 != modem_cmd_init())
+    MODEM_LOGE("modem command queue create error!\n");
+
   /*set up socket connection to clients*/
   if (pthread_create(&t2, NULL, (void*)modem_setup_clients_connect, NULL) < 0)
     MODEM_LOGE("Failed to create modemd listen accept thread");
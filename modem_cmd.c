@@ -0,0 +1,137 @@
+/*
+ *  modem_cmd.c - the commands to modem control.
+ *
+ *  The client connection and its side effects tell modem control to
+ *  reset the modem. They used to write strings such as "Modem Reset"
+ *  to a pipe, two of them could be read as one and the second got
+ *  lost. Now they post typed commands to a queue, the listen thread of
+ *  modem control is woken by an eventfd and takes them one by one.
+ *  Without the eventfd it's woken by a condition variable.
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "modem_control.h"
+#include "modem_cmd.h"
+
+static pthread_mutex_t s_cmdMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cmdCond = PTHREAD_COND_INITIALIZER;
+static modem_cmd s_cmds[MODEM_CMD_QUEUE_LEN];
+static int s_cmdHead;
+static int s_cmdNum;
+static int s_cmdEventFd = -1;
+
+static const char *s_cmdNames[MODEM_CMD_NUM] = {
+  MODEM_BLOCK,
+  MODEM_RESET,
+  PREPARE_RESET,
+  "Modem Assert",
+  "Modem Dump"
+};
+
+static const char *s_originNames[MODEM_CMD_FROM_NUM] = {
+  "block",
+  "assert",
+  "reset",
+  "dump",
+  "client"
+};
+
+uint64_t modem_cmd_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int modem_cmd_init(void) {
+  s_cmdEventFd = eventfd(0, EFD_CLOEXEC);
+  if (s_cmdEventFd < 0)
+    MODEM_LOGE("%s: eventfd error: %s, use a condition", __FUNCTION__,
+               strerror(errno));
+
+  return 0;
+}
+
+static int modem_cmd_push(modem_cmd_type type, modem_cmd_origin origin,
+                          uint32_t token) {
+  uint64_t one = 1;
+  modem_cmd *cmd;
+
+  pthread_mutex_lock(&s_cmdMutex);
+  if (s_cmdNum == MODEM_CMD_QUEUE_LEN) {
+    pthread_mutex_unlock(&s_cmdMutex);
+    MODEM_LOGE("%s: queue full, drop %s from %s", __FUNCTION__,
+               modem_cmd_name(type), modem_cmd_origin_name(origin));
+    return -1;
+  }
+  cmd = &s_cmds[(s_cmdHead + s_cmdNum) % MODEM_CMD_QUEUE_LEN];
+  cmd->type = type;
+  cmd->origin = origin;
+  cmd->time_ms = modem_cmd_now_ms();
+  cmd->token = token;
+  s_cmdNum++;
+  if (s_cmdEventFd < 0)
+    pthread_cond_signal(&s_cmdCond);
+  pthread_mutex_unlock(&s_cmdMutex);
+
+  /* the count stays until it's read, a wakeup can't be missed */
+  if (s_cmdEventFd >= 0 &&
+      write(s_cmdEventFd, &one, sizeof(one)) != sizeof(one))
+    MODEM_LOGE("%s: eventfd write error: %s", __FUNCTION__, strerror(errno));
+
+  MODEM_LOGD("%s: %s from %s", __FUNCTION__, modem_cmd_name(type),
+             modem_cmd_origin_name(origin));
+  return 0;
+}
+
+int modem_cmd_post(modem_cmd_type type, modem_cmd_origin origin) {
+  return modem_cmd_push(type, origin, 0);
+}
+
+int modem_cmd_post_request(modem_cmd_type type, uint32_t token) {
+  return modem_cmd_push(type, MODEM_CMD_FROM_CLIENT, token);
+}
+
+int modem_cmd_wait(modem_cmd *cmd) {
+  uint64_t cnt;
+  ssize_t n;
+
+  for (;;) {
+    pthread_mutex_lock(&s_cmdMutex);
+    /* no eventfd, the posts signal under the mutex */
+    while (s_cmdNum == 0 && s_cmdEventFd < 0)
+      pthread_cond_wait(&s_cmdCond, &s_cmdMutex);
+    if (s_cmdNum > 0) {
+      *cmd = s_cmds[s_cmdHead];
+      s_cmdHead = (s_cmdHead + 1) % MODEM_CMD_QUEUE_LEN;
+      s_cmdNum--;
+      pthread_mutex_unlock(&s_cmdMutex);
+      return 0;
+    }
+    pthread_mutex_unlock(&s_cmdMutex);
+
+    /* the posts since the last read, one read takes all of them */
+    n = read(s_cmdEventFd, &cnt, sizeof(cnt));
+    if (n < 0 && errno != EINTR) {
+      MODEM_LOGE("%s: eventfd read error: %s", __FUNCTION__, strerror(errno));
+      return -1;
+    }
+  }
+}
+
+const char *modem_cmd_name(modem_cmd_type type) {
+  if (type < 0 || type >= MODEM_CMD_NUM)
+    return "unknown";
+  return s_cmdNames[type];
+}
+
+const char *modem_cmd_origin_name(modem_cmd_origin origin) {
+  if (origin < 0 || origin >= MODEM_CMD_FROM_NUM)
+    return "unknown";
+  return s_originNames[origin];
+}
@@ -0,0 +1,55 @@
+/*
+ *  modem_cmd.h - the commands to modem control.
+ *
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#ifndef _MODEM_CMD_H
+#define _MODEM_CMD_H
+
+#include <stdint.h>
+
+/* queued commands before a post fails */
+#define MODEM_CMD_QUEUE_LEN 32
+
+typedef enum {
+  MODEM_CMD_BLOCKED = 0,   /* a client told the modem is blocked */
+  MODEM_CMD_RESET,         /* reload the modem */
+  MODEM_CMD_PREPARE_RESET, /* ask the modem to reset, reload if it doesn't */
+  MODEM_CMD_ASSERT,        /* assert the modem, from a client request */
+  MODEM_CMD_DUMP,          /* assert the modem to save a dump */
+  MODEM_CMD_NUM
+} modem_cmd_type;
+
+/* who posted the command */
+typedef enum {
+  MODEM_CMD_FROM_BLOCK = 0, /* the handling of "Modem Blocked" */
+  MODEM_CMD_FROM_ASSERT,    /* a modem assert broadcast */
+  MODEM_CMD_FROM_RESET,     /* a modem reset broadcast */
+  MODEM_CMD_FROM_DUMP,      /* the dump is complete or timed out */
+  MODEM_CMD_FROM_CLIENT,    /* a client request, answered when it's run */
+  MODEM_CMD_FROM_NUM
+} modem_cmd_origin;
+
+typedef struct {
+  modem_cmd_type type;
+  modem_cmd_origin origin;
+  uint64_t time_ms;        /* CLOCK_MONOTONIC of the post */
+  uint32_t token;          /* of a client request, 0 otherwise */
+} modem_cmd;
+
+/* before any post, falls back to a condition if eventfd fails */
+int modem_cmd_init(void);
+/* from any thread, -1 if the queue is full */
+int modem_cmd_post(modem_cmd_type type, modem_cmd_origin origin);
+/* a client request, token is passed to modem_client_request_done() */
+int modem_cmd_post_request(modem_cmd_type type, uint32_t token);
+/* the only consumer, blocks until a command comes, -1 on error */
+int modem_cmd_wait(modem_cmd *cmd);
+
+const char *modem_cmd_name(modem_cmd_type type);
+const char *modem_cmd_origin_name(modem_cmd_origin origin);
+uint64_t modem_cmd_now_ms(void);
+
+#endif /* _MODEM_CMD_H */
@@ -5,26 +5,64 @@
  */
 #include <cutils/sockets.h>
 #include <cutils/properties.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "modem_control.h"
+#include "eventmonitor.h"
+#include "modem_cmd.h"
 #include "modem_connect.h"
+#include "modem_event_proto.h"
+#include "modem_state.h"
+#include "modem_state_page.h"
 
-#define MAX_CLIENT_NUM          20
+/* a new client is refused above it, no client is evicted */
+#define MAX_CLIENT_NUM          1024
+#define CLIENT_TABLE_INIT_SIZE  16
 #define BUFFER_SIZE             128
+#define MAX_EPOLL_EVENTS        32
 #define TIME_FOR_MD_DUMP        (60 * 5) // modem memory dump time out (5 min)
+/* pending broadcast side effects, the worker runs them in order */
+#define SIDE_EFFECT_QUEUE_LEN   32
+/* AT+CGSN reply deadline */
+#define IMEI_READ_TIMEOUT_MS    3000
+/* recent broadcasts kept for replay */
+#define EVENT_REPLAY_LEN        64
+/* messages queued for a client which doesn't read, a replay fits in */
+#define CLIENT_QUEUE_LEN        EVENT_REPLAY_LEN
+/* log every n dropped messages of a client */
+#define CLIENT_DROP_LOG_INTERVAL 64
+#define CLIENT_PRIORITY_MAX     16
+#define CLIENT_NAME_LEN         32
+/* client requests run by modem control at once */
+#define RPC_PENDING_MAX         16
+/* text of a response */
+#define RPC_TEXT_LEN            1024
 
 #define SOCKET_NAME_MODEMD   "modemd"
 #define MODEM_SAVE_DUMP_PROP    "persist.vendor.sys.modem.save_dump"
 #define WIFI_ONLY_IMET_PROP     "vendor.sys.wifionly.imei"
 #define WIFI_ONLY_VERSION_PROP  "persist.vendor.sys.wifionly"
-
-typedef enum {
-    MODEMCON_STATE_OFFLINE   = 0,
-    MODEMCON_STATE_ALIVE     = 1,
-    MODEMCON_STATE_ASSERT    = 2,
-    MODEMCON_STATE_RESET     = 3,
-} ModemState;
+/* client queue full: "drop_oldest"(default) or "disconnect" */
+#define MODEM_CLIENT_OVERFLOW_PROP "persist.vendor.modem.client_overflow"
+/*
+ * "name:tier,uid:tier", name is the base name of the client's argv[0],
+ * tier is critical, normal(default) or low.
+ */
+#define MODEM_CLIENT_PRIORITY_PROP "persist.vendor.modem.client_priority"
+#define MODEM_CLIENT_PRIORITY_DEFAULT \
+    "rild:critical,slogmodem:critical,audioserver:critical"
+#define MODEM_CLIENT_STATS      "Modem Client Stats"
+#define MODEM_SUBSCRIBE         "Modem Subscribe"
+#define MODEM_REPLAY            "Modem Replay"
+#define MODEM_STATE_PAGE        "Modem State Page"
+#define MODEM_REQUEST           "Modem Request"
+#define MODEM_RESPONSE          "Modem Response"
 
 
 enum {
@@ -33,248 +71,1512 @@ enum {
   DUMP_COMPLETE
 };
 
-static int s_fdModemCtrlRead = -1;   // used for modem control read modem reset or block
-static int s_fdModemCtrlWrite = -1;  // used for info modem control modem reset or block
-static int s_clientFd[MAX_CLIENT_NUM];          // modem control client fd
-static int s_notifypipe[] = {-1, -1};           // listen thread notify by pipe
-static bool s_needResetModem = true;    // P-ARM Modem Assert doesn't need to reset modem
+/*
+ * a broadcast goes to the critical tier first, then the normal one,
+ * the low tier is only queued and sent by the reactor in a batch.
+ */
+enum {
+  CLIENT_TIER_CRITICAL = 0,
+  CLIENT_TIER_NORMAL,
+  CLIENT_TIER_LOW,
+  CLIENT_TIER_NUM
+};
+
+/* what a broadcast does besides the fan-out */
+enum {
+  SIDE_EFFECT_ALIVE = 0,   /* start nvitemd, read imei on wifi only */
+  SIDE_EFFECT_ASSERT,      /* stop nvitemd, reset now or after dump */
+  SIDE_EFFECT_RESET,       /* stop nvitemd, tell modem control */
+  SIDE_EFFECT_BLOCK        /* check the loop, reset now or after dump */
+};
+
+/* a broadcast message, shared by the queues of all clients */
+typedef struct {
+  int ref;
+  int type;             /* enum modem_event_type */
+  uint32_t seq;         /* broadcast seq, 0 for replies */
+  uint64_t time;        /* CLOCK_BOOTTIME in ns of the broadcast */
+  int size;
+  char data[0];
+} MODEM_MSG_S;
+
+typedef struct _MODEM_CLIENT {
+  int fd;               /* -1 once closed */
+  int index;            /* in s_clients, -1 once closed */
+  bool framed;          /* connected to modemd_v2 */
+  uint32_t mask;        /* subscribed event types */
+  MODEM_MSG_S *queue[CLIENT_QUEUE_LEN];
+  int head;
+  int depth;
+  int sent;             /* sent bytes of the head message */
+  bool pollout;         /* EPOLLOUT is watched */
+  /* peer and counters */
+  pid_t pid;
+  uid_t uid;
+  char name[CLIENT_NAME_LEN];  /* base name of argv[0] */
+  int tier;
+  uint32_t latency_seq; /* last broadcast counted in the tier latency */
+  time_t connect_time;
+  int max_depth;
+  unsigned int dropped;
+  unsigned int sent_msgs;
+  unsigned int recv_msgs;
+  struct _MODEM_CLIENT *next;  /* in s_closedClients */
+} MODEM_CLIENT_S;
+
+/* a request run by modem control, answered when it's done */
+typedef struct {
+  uint32_t token;       /* 0 if the slot is free */
+  MODEM_CLIENT_S *client;
+  uint32_t id;
+  int op;
+  uint64_t start_us;
+} RPC_PENDING_S;
+
+/* a rule of the priority map, uid rule if name is empty */
+typedef struct {
+  char name[CLIENT_NAME_LEN];
+  uid_t uid;
+  int tier;
+} CLIENT_PRIORITY_S;
+
+/* delivery latency of the broadcasts to a tier */
+typedef struct {
+  unsigned int count;
+  uint64_t total_us;
+  uint64_t max_us;
+} TIER_STATS_S;
+
+/* a listen socket, the epoll data of it */
+typedef struct {
+  int fd;
+  bool framed;
+} MODEM_LISTEN_S;
+
+/*
+ * the live clients, dense, a closed one is swapped with the last.
+ * the epoll data of a client points to it, so it's freed only after
+ * the events which may refer to it are handled.
+ */
+static MODEM_CLIENT_S **s_clients = NULL;
+static int s_clientNum = 0;
+static int s_clientSize = 0;
+static MODEM_CLIENT_S *s_closedClients = NULL;
+static bool s_overflowDisconnect = false;  // close the client if queue full
+static int s_epollFd = -1;                      // listen sockets and clients
+static MODEM_LISTEN_S s_listen = {-1, false};      // legacy modemd socket
+static MODEM_LISTEN_S s_eventListen = {-1, true};  // framed modemd_v2 socket
+static uint32_t s_eventSeq = 0;                 // seq of the last broadcast
+static MODEM_MSG_S *s_eventRing[EVENT_REPLAY_LEN];  // the recent broadcasts
+static CLIENT_PRIORITY_S s_priorities[CLIENT_PRIORITY_MAX];
+static int s_priorityNum = 0;
+static TIER_STATS_S s_tierStats[CLIENT_TIER_NUM];   // with s_writeMutex held
+static RPC_PENDING_S s_rpcPending[RPC_PENDING_MAX];  // with s_writeMutex held
+static uint32_t s_rpcToken = 0;
+static TIER_STATS_S s_rpcStats;                 // latency of the responses
+static unsigned int s_rpcFailed = 0;
+static const char *s_tierNames[CLIENT_TIER_NUM] = {
+  "critical", "normal", "low"
+};
 static bool s_wakeLocking = false;
-static ModemState s_modemState = MODEMCON_STATE_OFFLINE;
 static pthread_mutex_t s_dumpMtx = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t s_dumpCond = PTHREAD_COND_INITIALIZER;
+/* the modem blocked handling on the worker, with s_dumpMtx held */
+static bool s_blockRunning = false;    /* dispatch_modem_blocked() runs */
+static bool s_blockDumped = false;     /* dump completed while it runs */
+static bool s_blockLaterReset = false; /* reset after dump complete */
 static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
+/* side effect queue, fed under s_writeMutex, drained by the worker */
+static int s_sideEffects[SIDE_EFFECT_QUEUE_LEN];
+static int s_sideEffectHead = 0;
+static int s_sideEffectNum = 0;
+static bool s_sideEffectWorker = false;
+static pthread_mutex_t s_sideEffectMtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_sideEffectCond = PTHREAD_COND_INITIALIZER;
 
 /* start / stop nvitemd accodring modem state */
 static void control_nvitemd(int isStart);
 
-/* before modem control write modem state to clients, process according modem state */
+/* before modem control write modem state to clients, queue its side effects */
 static void modem_ctrl_process_message(void *buf, int size);
 
+/* run the side effects of the broadcasts out of s_writeMutex */
+static void *modem_side_effect_worker(void *param);
+
+/* queue a side effect, or run it here without the worker */
+static void modem_side_effect_post(int effect);
+
 /* recive modem blocked from clinet: rild */
-static int dispatch_modem_blocked(int blockFd);
+static int dispatch_modem_blocked(void);
 
 /* when modem assert, and need reset, and need save dump log,
  * wait for slogmodem dump complete or wait for 5 minutes, then send modem reset */
-static void *write_reset_to_modem_ctrl(void *ctrlFd);
+static void *write_reset_to_modem_ctrl(void *param);
 
-/* read message from clients: slogmodem/audio/rild/network/aprd/modemnotifier */
-static void *modem_ctrl_read_thread(void);
+/* remove client from the reactor and close it, with s_writeMutex held */
+static void modem_client_close(MODEM_CLIENT_S *client);
 
+/* handle message from clients: slogmodem/audio/rild/network/aprd/modemnotifier */
+static void modem_ctrl_dispatch_message(char *controlinfo, int readnum);
+
+
+static MODEM_MSG_S *modem_msg_alloc(const void *buf, int size) {
+  MODEM_MSG_S *msg = malloc(sizeof(MODEM_MSG_S) + size);
+
+  if (msg) {
+    msg->ref = 0;
+    msg->type = MODEM_EVENT_OTHER;
+    msg->seq = 0;
+    msg->time = 0;
+    msg->size = size;
+    memcpy(msg->data, buf, size);
+  }
+  return msg;
+}
+
+static void modem_msg_put(MODEM_MSG_S *msg) {
+  if (--msg->ref <= 0)
+    free(msg);
+}
+
+static const struct {
+  const char *text;
+  int type;
+} s_eventTypes[] = {
+  {MODEM_LOAD_PROGRESS, MODEM_EVENT_LOAD_PROGRESS},
+  {MODEM_LOAD_DONE, MODEM_EVENT_LOAD_DONE},
+  {"AGDSP Assert", MODEM_EVENT_AGDSP_ASSERT},
+  {MODEM_ALIVE, MODEM_EVENT_ALIVE},
+  {MODEM_ASSERT, MODEM_EVENT_ASSERT},
+  {MODEM_RESET, MODEM_EVENT_RESET},
+  {MODEM_BLOCK, MODEM_EVENT_BLOCKED},
+  {"Modem State", MODEM_EVENT_STATE},
+  {MODEM_CLIENT_STATS, MODEM_EVENT_CLIENT_STATS},
+  {"DUMP", MODEM_EVENT_DUMP},
+};
+
+static const char *s_rpcOps[MODEM_RPC_OP_MAX] = {
+  [MODEM_RPC_GET_STATE] = "state",
+  [MODEM_RPC_GET_LOAD] = "load",
+  [MODEM_RPC_RESET] = "reset",
+  [MODEM_RPC_ASSERT] = "assert",
+  [MODEM_RPC_DUMP] = "dump",
+  [MODEM_RPC_METRICS] = "metrics",
+};
+
+static const struct {
+  const char *name;
+  uint32_t mask;
+} s_subscribeClasses[] = {
+  {"alive", MODEM_SUBSCRIBE_ALIVE},
+  {"assert", MODEM_SUBSCRIBE_ASSERT},
+  {"reset", MODEM_SUBSCRIBE_RESET},
+  {"block", MODEM_SUBSCRIBE_BLOCK},
+  {"agdsp", MODEM_SUBSCRIBE_AGDSP},
+  {"dump", MODEM_SUBSCRIBE_DUMP},
+  {"load", MODEM_SUBSCRIBE_LOAD},
+  {"other", MODEM_SUBSCRIBE_OTHER},
+  {"all", MODEM_EVENT_MASK_ALL},
+};
+
+/* the type of a legacy text message */
+static int modem_event_classify(const char *text) {
+  unsigned int i;
+
+  for (i = 0; i < sizeof(s_eventTypes) / sizeof(s_eventTypes[0]); i++) {
+    if (strstr(text, s_eventTypes[i].text))
+      return s_eventTypes[i].type;
+  }
+  return MODEM_EVENT_OTHER;
+}
+
+/*
+ * a framed record of the text message, the payload is NUL terminated,
+ * the type is classified from the text if it's negative.
+ */
+static MODEM_MSG_S *modem_event_alloc(const void *buf, int size, uint32_t seq,
+                                      int type) {
+  struct modem_event_header header;
+  struct timespec ts;
+  MODEM_MSG_S *msg;
+  int len = size;
+
+  if (size == 0 || ((const char *)buf)[size - 1] != '\0')
+    len++;
+  if (len > (int)MODEM_EVENT_MAX_PAYLOAD)
+    len = MODEM_EVENT_MAX_PAYLOAD;
+
+  msg = malloc(sizeof(MODEM_MSG_S) + sizeof(header) + len);
+  if (NULL == msg)
+    return NULL;
+
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  memset(&header, 0, sizeof(header));
+  header.version = MODEM_EVENT_VERSION;
+  header.len = len;
+  header.seq = seq;
+  header.timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  msg->ref = 0;
+  msg->seq = seq;
+  msg->time = header.timestamp;
+  msg->size = sizeof(header) + len;
+  memcpy(msg->data + sizeof(header), buf, min(size, len));
+  msg->data[msg->size - 1] = '\0';
+  header.type = type < 0 ? modem_event_classify(msg->data + sizeof(header))
+                         : type;
+  msg->type = header.type;
+  memcpy(msg->data, &header, sizeof(header));
+
+  return msg;
+}
+
+/* msg is written to client, a broadcast counts in the latency of the tier */
+static void modem_client_delivered(MODEM_CLIENT_S *client, MODEM_MSG_S *msg) {
+  TIER_STATS_S *stats = &s_tierStats[client->tier];
+  struct timespec ts;
+  uint64_t us;
+
+  client->sent_msgs++;
+  /* replies and replayed broadcasts */
+  if (msg->seq == 0 || msg->seq <= client->latency_seq)
+    return;
+  client->latency_seq = msg->seq;
+
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  us = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - msg->time) / 1000;
+  stats->count++;
+  stats->total_us += us;
+  if (us > stats->max_us)
+    stats->max_us = us;
+}
+
+/* watch EPOLLOUT only while something is queued */
+static void modem_client_update_events(MODEM_CLIENT_S *client) {
+  struct epoll_event ev;
+  bool pollout = client->depth > 0;
+
+  if (pollout == client->pollout)
+    return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | (pollout ? EPOLLOUT : 0);
+  ev.data.ptr = client;
+  if (!epoll_ctl(s_epollFd, EPOLL_CTL_MOD, client->fd, &ev))
+    client->pollout = pollout;
+}
+
+/* write the queued messages until the socket is full, -1 if it's broken */
+static int modem_client_flush(MODEM_CLIENT_S *client) {
+  MODEM_MSG_S *msg;
+  int n;
+
+  while (client->depth > 0) {
+    msg = client->queue[client->head];
+    n = send(client->fd, msg->data + client->sent, msg->size - client->sent,
+             MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0)
+      return -1;
+
+    client->sent += n;
+    if (client->sent == msg->size) {
+      modem_client_delivered(client, msg);
+      modem_msg_put(msg);
+      client->queue[client->head] = NULL;
+      client->head = (client->head + 1) % CLIENT_QUEUE_LEN;
+      client->depth--;
+      client->sent = 0;
+    }
+  }
+
+  modem_client_update_events(client);
+  return 0;
+}
+
+/*
+ * queue msg, if the queue is full, drop the oldest message which is not
+ * partly sent, or return -1 to close the client if it's the policy.
+ */
+static int modem_client_enqueue(MODEM_CLIENT_S *client, MODEM_MSG_S *msg) {
+  int drop, tail;
+
+  if (client->depth == CLIENT_QUEUE_LEN) {
+    if (s_overflowDisconnect) {
+      MODEM_LOGE("client %d queue full, disconnect it", client->fd);
+      return -1;
+    }
+
+    /* the partly sent head moves into the slot of the dropped one */
+    drop = client->head;
+    if (client->sent > 0) {
+      drop = (client->head + 1) % CLIENT_QUEUE_LEN;
+      modem_msg_put(client->queue[drop]);
+      client->queue[drop] = client->queue[client->head];
+    } else {
+      modem_msg_put(client->queue[drop]);
+    }
+    client->queue[client->head] = NULL;
+    client->head = (client->head + 1) % CLIENT_QUEUE_LEN;
+    client->depth--;
+
+    if (client->dropped++ % CLIENT_DROP_LOG_INTERVAL == 0)
+      MODEM_LOGE("client %d queue full, dropped %u messages", client->fd,
+                 client->dropped);
+  }
+
+  tail = (client->head + client->depth) % CLIENT_QUEUE_LEN;
+  client->queue[tail] = msg;
+  msg->ref++;
+  client->depth++;
+  if (client->depth > client->max_depth)
+    client->max_depth = client->depth;
+
+  return 0;
+}
+
+/* send or queue msg to one client, -1 if the client should be closed */
+static int modem_client_send(MODEM_CLIENT_S *client, MODEM_MSG_S *msg) {
+  int n = 0;
+
+  /* nothing queued, try to write it at once */
+  if (client->depth == 0) {
+    n = send(client->fd, msg->data, msg->size, MSG_NOSIGNAL);
+    if (n == msg->size) {
+      modem_client_delivered(client, msg);
+      return 0;
+    }
+    /* the caller logs the error and closes the client */
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    /* short write, the rest is queued */
+    MODEM_LOGD("write %d bytes to client %d: %d", msg->size, client->fd, n);
+  }
+
+  if (modem_client_enqueue(client, msg))
+    return -1;
+
+  /* the rest of a partly written message is the head */
+  if (client->depth == 1 && n > 0)
+    client->sent = n;
+
+  modem_client_update_events(client);
+  return 0;
+}
+
+/* queue msg without writing, the reactor flushes it on EPOLLOUT */
+static int modem_client_defer(MODEM_CLIENT_S *client, MODEM_MSG_S *msg) {
+  if (modem_client_enqueue(client, msg))
+    return -1;
+
+  modem_client_update_events(client);
+  return 0;
+}
+
+/*
+ * called with s_writeMutex held, the message is classified once,
+ * legacy clients get the text and framed clients the record.
+ */
+static int write_data_to_clients(void *buf, int size)
+{
+  MODEM_MSG_S *msg, *event, *m;
+  MODEM_CLIENT_S *client;
+  int i, tier, err;
+  int ret = size;
+
+  msg = modem_msg_alloc(buf, size);
+  event = modem_event_alloc(buf, size, 0, -1);
+  if (NULL == msg || NULL == event) {
+    free(msg);
+    free(event);
+    return -1;
+  }
+
+  /* load progress is outdated soon, it has seq 0 and isn't kept */
+  if (event->type != MODEM_EVENT_LOAD_PROGRESS) {
+    event->seq = ++s_eventSeq;
+    ((struct modem_event_header *)event->data)->seq = s_eventSeq;
+  }
+  msg->type = event->type;
+  msg->seq = event->seq;
+  msg->time = event->time;
+
+  if (event->seq) {
+    modem_state_set_event(s_eventSeq,
+                          event->type == MODEM_EVENT_ASSERT ||
+                          event->type == MODEM_EVENT_AGDSP_ASSERT
+                          ? event->data + sizeof(struct modem_event_header)
+                          : NULL);
+
+    /* keep it for replay, it replaces the one EVENT_REPLAY_LEN before */
+    m = s_eventRing[s_eventSeq % EVENT_REPLAY_LEN];
+    if (m)
+      modem_msg_put(m);
+    s_eventRing[s_eventSeq % EVENT_REPLAY_LEN] = event;
+    event->ref++;
+  }
+
+  /*
+   * info socket clients that modem is assert/hangup/blocked, a tier
+   * after another, backwards, a closed client is replaced by a visited one.
+   */
+  for (tier = 0; tier < CLIENT_TIER_NUM; tier++) {
+    for (i = s_clientNum - 1; i >= 0; i--) {
+      client = s_clients[i];
+      /* don't wake a client which isn't interested */
+      if (client->tier != tier ||
+          !(client->mask & MODEM_EVENT_MASK(event->type)))
+          continue;
+      m = client->framed ? event : msg;
+      if (tier == CLIENT_TIER_LOW)
+          err = modem_client_defer(client, m);
+      else
+          err = modem_client_send(client, m);
+      if (err) {
+          MODEM_LOGE("close client %d pid %d, errno: %d, err: %s",
+                      client->fd, client->pid, errno, strerror(errno));
+          modem_client_close(client);
+          ret = -1;
+      }
+    }
+  }
+
+  /* no client queued it */
+  if (msg->ref == 0)
+    free(msg);
+  if (event->ref == 0)
+    free(event);
+
+  return ret;
+}
 
 int modem_write_data_to_clients(void *buf, int size)
 {
-  int i;
-  int ret = 0;
+  int ret;
 
   pthread_mutex_lock(&s_writeMutex);
 
   modem_ctrl_process_message(buf, size);
-
-  /* info socket clients that modem is assert/hangup/blocked */
-  for (i = 0; i < MAX_CLIENT_NUM; i++) {
-      if (s_clientFd[i] >= 0) {
-          ret = write(s_clientFd[i], buf, size);
-          MODEM_LOGD("write %d bytes to s_clientFd[%d]: %d", size, i,
-                      s_clientFd[i]);
-          if (ret < 0) {
-              MODEM_LOGE("reset client_fd[%d] = -1, errno: %d, err: %s",
-                          i, errno, strerror(errno));
-              close(s_clientFd[i]);
-              s_clientFd[i] = -1;
-          }
-      }
-  }
+  ret = write_data_to_clients(buf, size);
 
   pthread_mutex_unlock(&s_writeMutex);
   return ret;
 }
 
-int modem_read_data_from_clients(void *buf, int size)
+/* only info clients, such as load progress, no state change */
+int modem_notify_clients(void *buf, int size)
 {
-  int cnt = 0;
-  while (s_fdModemCtrlRead < 0) {
-    MODEM_LOGE("%s: s_fdModemCtrlRead = %d", __FUNCTION__, s_fdModemCtrlRead);
-    return -1;
-  }
+  int ret;
 
-  cnt = read(s_fdModemCtrlRead, buf, size);
-  if (cnt <= 0) {
-    MODEM_LOGE("%s: errno(%d) %s\n", __FUNCTION__, errno,
-               strerror(errno));
-  }
-  return cnt;
+  pthread_mutex_lock(&s_writeMutex);
+  ret = write_data_to_clients(buf, size);
+  pthread_mutex_unlock(&s_writeMutex);
+
+  return ret;
 }
 
-void *modem_setup_clients_connect(void) {
-    int sfd, n, index;
-    int filedes[2];
-    pthread_t tid;
-    pthread_attr_t attr;
-    for (index = 0; index < MAX_CLIENT_NUM; index++) {
-        s_clientFd[index] = -1;
-    }
-    /* s_notifypipe[1]: used for notify;
-     * s_notifypipe[0]: used for receiving notify,then update the listen fds
-     */
-    if (pipe(s_notifypipe) < 0) {
-        MODEM_LOGE("pipe error!\n");
+static const char *modem_state_message(void) {
+    switch (modem_ctrl_get_modem_state()) {
+      case MODEM_STATE_ALIVE:
+        return "Modem State: Alive";
+      case MODEM_STATE_ASSERT:
+      case MODEM_STATE_BLOCK:
+        return "Modem State: Assert";
+      case MODEM_STATE_RESET:
+      case MODEM_STATE_REBOOT_EXT_MODEM:
+        return "Modem State: Reset";
+      default:
+        return "Modem State: Offline";
     }
+}
+
+static void modem_client_close(MODEM_CLIENT_S *client) {
+    MODEM_CLIENT_S *last;
+    int i;
 
-    if (pipe(filedes) < 0) {
-        RLOGE("Error in pipe() errno:%d", errno);
+    if (client->index < 0)
+        return;
+
+    MODEM_LOGD("%s: close client %d pid %d, queued %d, max depth %d, "
+               "dropped %u, sent %u, received %u", __FUNCTION__, client->fd,
+               client->pid, client->depth, client->max_depth, client->dropped,
+               client->sent_msgs, client->recv_msgs);
+
+    /* swap the last one into its slot */
+    last = s_clients[--s_clientNum];
+    s_clients[client->index] = last;
+    last->index = client->index;
+    s_clients[s_clientNum] = NULL;
+    client->index = -1;
+
+    epoll_ctl(s_epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    /* its requests still run, nobody gets the response */
+    for (i = 0; i < RPC_PENDING_MAX; i++) {
+        if (s_rpcPending[i].client == client)
+            memset(&s_rpcPending[i], 0, sizeof(s_rpcPending[i]));
+    }
+    while (client->depth > 0) {
+        modem_msg_put(client->queue[client->head]);
+        client->queue[client->head] = NULL;
+        client->head = (client->head + 1) % CLIENT_QUEUE_LEN;
+        client->depth--;
     }
-    s_fdModemCtrlRead = filedes[0];
-    s_fdModemCtrlWrite = filedes[1];
 
-    sfd = socket_local_server(SOCKET_NAME_MODEMD,
-                              ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
-    if (sfd < 0) {
-        MODEM_LOGE("%s: cannot create local socket server, errno: %d, err: %s",
-                    __FUNCTION__, errno, strerror(errno));
+    client->next = s_closedClients;
+    s_closedClients = client;
+}
+
+/* free the closed clients, no pending event refers to them */
+static void modem_clients_reap(void) {
+    MODEM_CLIENT_S *client;
+
+    pthread_mutex_lock(&s_writeMutex);
+    while (s_closedClients) {
+        client = s_closedClients;
+        s_closedClients = client->next;
+        free(client);
+    }
+    pthread_mutex_unlock(&s_writeMutex);
+}
+
+/* reply to one client, with s_writeMutex held */
+/* a framed reply has seq 0, or the seq it's up to date with */
+static void modem_client_reply_seq(MODEM_CLIENT_S *client, const char *reply,
+                                   int type, uint32_t seq) {
+    MODEM_MSG_S *msg;
+
+    if (client->framed)
+        msg = modem_event_alloc(reply, strlen(reply) + 1, seq, type);
+    else
+        msg = modem_msg_alloc(reply, strlen(reply) + 1);
+
+    if (NULL == msg)
+        return;
+    if (modem_client_send(client, msg))
+        modem_client_close(client);
+    if (msg->ref == 0)
+        free(msg);
+}
+
+static void modem_client_reply(MODEM_CLIENT_S *client, const char *reply,
+                               int type) {
+    modem_client_reply_seq(client, reply, type, 0);
+}
+
+/*
+ * reply the O_RDONLY fd of the state page, with s_writeMutex held,
+ * the fd goes with the first byte, so nothing may be queued before it.
+ */
+static void modem_client_send_page(MODEM_CLIENT_S *client) {
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    MODEM_MSG_S *msg;
+    char text[64];
+    int fd, n;
+
+    fd = modem_state_page_fd();
+    if (fd < 0) {
+        modem_client_reply(client, MODEM_STATE_PAGE ": none",
+                           MODEM_EVENT_STATE_PAGE);
+        return;
+    }
+    if (client->depth > 0 && modem_client_flush(client)) {
+        modem_client_close(client);
+        return;
+    }
+    if (client->depth > 0) {
+        modem_client_reply(client, MODEM_STATE_PAGE ": retry",
+                           MODEM_EVENT_STATE_PAGE);
+        return;
+    }
+
+    snprintf(text, sizeof(text), "%s: size=%d", MODEM_STATE_PAGE,
+             MODEM_STATE_PAGE_SIZE);
+    if (client->framed)
+        msg = modem_event_alloc(text, strlen(text) + 1, 0,
+                                MODEM_EVENT_STATE_PAGE);
+    else
+        msg = modem_msg_alloc(text, strlen(text) + 1);
+    if (NULL == msg)
+        return;
+
+    iov.iov_base = msg->data;
+    iov.iov_len = msg->size;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgbuf;
+    mh.msg_controllen = sizeof(cmsgbuf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    do {
+        n = sendmsg(client->fd, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    MODEM_LOGD("%s: client %d pid %d, fd %d: %d", __FUNCTION__, client->fd,
+               client->pid, fd, n);
+
+    if (n == msg->size) {
+        modem_client_delivered(client, msg);
+    } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        modem_client_close(client);
+    } else if (n < 0) {
+        modem_client_reply(client, MODEM_STATE_PAGE ": retry",
+                           MODEM_EVENT_STATE_PAGE);
+    } else if (modem_client_enqueue(client, msg)) {
+        modem_client_close(client);
+    } else {
+        /* the fd went with the written part, queue the rest */
+        client->sent = n;
+        modem_client_update_events(client);
+    }
+
+    if (msg->ref == 0)
+        free(msg);
+}
+
+/* metadata and queue depth of every client, with s_writeMutex held */
+static char *modem_clients_stats(void) {
+    MODEM_CLIENT_S *client;
+    int i, len, size;
+    char *buf;
+
+    size = 64 + CLIENT_TIER_NUM * 80 + s_clientNum * (160 + CLIENT_NAME_LEN);
+    buf = malloc(size);
+    if (NULL == buf)
         return NULL;
+
+    len = snprintf(buf, size, "%s: clients=%d", MODEM_CLIENT_STATS,
+                   s_clientNum);
+    /* how long after the broadcast a tier got it */
+    for (i = 0; i < CLIENT_TIER_NUM && len < size; i++) {
+        TIER_STATS_S *stats = &s_tierStats[i];
+
+        len += snprintf(buf + len, size - len, "; tier %s delivered=%u "
+                        "avg=%lluus max=%lluus", s_tierNames[i], stats->count,
+                        (unsigned long long)(stats->count ?
+                            stats->total_us / stats->count : 0),
+                        (unsigned long long)stats->max_us);
     }
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_create(&tid, &attr, (void*)modem_ctrl_read_thread, NULL);
-    for (;;) {
-        MODEM_LOGD("%s: Waiting for new connect ...", __FUNCTION__);
-        if ((n = accept(sfd, NULL, NULL)) == -1) {
-            MODEM_LOGE("%s  accept error\n", __FUNCTION__);
+    for (i = 0; i < s_clientNum && len < size; i++) {
+        client = s_clients[i];
+        len += snprintf(buf + len, size - len, "; fd=%d pid=%d uid=%d "
+                        "name=%s tier=%s since=%ld %s mask=0x%x depth=%d "
+                        "max=%d dropped=%u sent=%u received=%u", client->fd,
+                        client->pid, client->uid, client->name,
+                        s_tierNames[client->tier], (long)client->connect_time,
+                        client->framed ? "framed" : "legacy", client->mask,
+                        client->depth, client->max_depth, client->dropped,
+                        client->sent_msgs, client->recv_msgs);
+    }
+    return buf;
+}
+
+static uint64_t modem_rpc_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char *modem_rpc_op_name(int op) {
+    if (op <= 0 || op >= MODEM_RPC_OP_MAX)
+        return "unknown";
+    return s_rpcOps[op];
+}
+
+/* the response to a request, with s_writeMutex held */
+static void modem_rpc_respond(MODEM_CLIENT_S *client, uint32_t id, int op,
+                              int status, uint64_t start_us,
+                              const char *text) {
+    struct modem_rpc_response response;
+    uint64_t latency_us = modem_rpc_now_us() - start_us;
+    MODEM_MSG_S *msg;
+    char *buf;
+    int len;
+
+    s_rpcStats.count++;
+    s_rpcStats.total_us += latency_us;
+    if (latency_us > s_rpcStats.max_us)
+        s_rpcStats.max_us = latency_us;
+    if (status)
+        s_rpcFailed++;
+    MODEM_LOGD("%s: client %d pid %d, id %u %s: %d in %lluus", __FUNCTION__,
+               client->fd, client->pid, id, modem_rpc_op_name(op), status,
+               (unsigned long long)latency_us);
+
+    /* the text as long as it is, a record is cut to the max payload */
+    len = sizeof(response) + strlen(text) + 128;
+    buf = malloc(len);
+    if (NULL == buf)
+        return;
+    if (client->framed) {
+        response.id = id;
+        response.op = op;
+        response.status = status;
+        response.latency_us = latency_us;
+        memcpy(buf, &response, sizeof(response));
+        snprintf(buf + sizeof(response),
+                 min(len, (int)MODEM_EVENT_MAX_PAYLOAD) - sizeof(response),
+                 "%s", text);
+        len = sizeof(response) + strlen(buf + sizeof(response)) + 1;
+        msg = modem_event_alloc(buf, len, 0, MODEM_EVENT_RESPONSE);
+    } else {
+        snprintf(buf, len, "%s: id=%u op=%s status=%d latency=%lluus; %s",
+                 MODEM_RESPONSE, id, modem_rpc_op_name(op), status,
+                 (unsigned long long)latency_us, text);
+        msg = modem_msg_alloc(buf, strlen(buf) + 1);
+    }
+    free(buf);
+
+    if (NULL == msg)
+        return;
+    if (modem_client_send(client, msg))
+        modem_client_close(client);
+    if (msg->ref == 0)
+        free(msg);
+}
+
+static void modem_rpc_state(char *text, int size) {
+    struct modem_state_page page;
+
+    modem_state_read(&page);
+    snprintf(text, size, "state=%d since=%llu seq=%u resets=%u asserts=%u "
+             "assert=%s", page.state, (unsigned long long)page.state_time,
+             page.event_seq, page.reset_count, page.assert_count,
+             page.last_assert);
+}
+
+static int modem_rpc_load(uint32_t system, char *text, int size) {
+    const struct modem_state_load_info *info;
+    struct modem_state_page page;
+    uint32_t i;
+    int len;
+
+    if (system >= MODEM_STATE_SYS_NUM) {
+        snprintf(text, size, "no system %u", system);
+        return -EINVAL;
+    }
+
+    modem_state_read(&page);
+    info = &page.load_info[system];
+    len = snprintf(text, size, "type=0x%x ret=%d done=%uKB time=%ums "
+                   "base=0x%llx size=0x%x all_base=0x%llx all_size=0x%x "
+                   "regions=%u", page.load_type, page.load_ret,
+                   page.load_done_kb, page.load_time_ms,
+                   (unsigned long long)info->modem_base, info->modem_size,
+                   (unsigned long long)info->all_base, info->all_size,
+                   info->region_cnt);
+    for (i = 0; i < info->region_cnt && len < size; i++) {
+        len += snprintf(text + len, size - len, "; %s 0x%llx 0x%x",
+                        info->regions[i].name,
+                        (unsigned long long)info->regions[i].address,
+                        info->regions[i].size);
+    }
+    return 0;
+}
+
+/* the request, uevent and client stats, NULL if out of memory */
+static char *modem_rpc_metrics(void) {
+    char *stats = modem_clients_stats();
+    char events[RPC_TEXT_LEN];
+    char *buf;
+    int size;
+
+    if (NULL == stats)
+        return NULL;
+    modem_event_stats(events, sizeof(events));
+    size = strlen(stats) + strlen(events) + 128;
+    buf = malloc(size);
+    if (buf)
+        snprintf(buf, size, "requests=%u failed=%u avg=%lluus max=%lluus; "
+                 "%s; %s", s_rpcStats.count, s_rpcFailed,
+                 (unsigned long long)(s_rpcStats.count ?
+                     s_rpcStats.total_us / s_rpcStats.count : 0),
+                 (unsigned long long)s_rpcStats.max_us, events, stats);
+    free(stats);
+    return buf;
+}
+
+/*
+ * queue a request to modem control, the response is sent by
+ * modem_client_request_done(), with s_writeMutex held.
+ */
+static int modem_rpc_queue(MODEM_CLIENT_S *client, uint32_t id, int op,
+                           uint64_t start_us) {
+    RPC_PENDING_S *pending = NULL;
+    int i, type;
+
+    for (i = 0; i < RPC_PENDING_MAX && NULL == pending; i++) {
+        if (s_rpcPending[i].token == 0)
+            pending = &s_rpcPending[i];
+    }
+    if (NULL == pending)
+        return -EBUSY;
+
+    if (++s_rpcToken == 0)
+        s_rpcToken = 1;
+    if (op == MODEM_RPC_RESET)
+        type = MODEM_CMD_RESET;
+    else if (op == MODEM_RPC_ASSERT)
+        type = MODEM_CMD_ASSERT;
+    else
+        type = MODEM_CMD_DUMP;
+    if (modem_cmd_post_request(type, s_rpcToken))
+        return -EBUSY;
+
+    pending->token = s_rpcToken;
+    pending->client = client;
+    pending->id = id;
+    pending->op = op;
+    pending->start_us = start_us;
+    return 0;
+}
+
+/* a request of a client, with s_writeMutex held */
+static void modem_client_request(MODEM_CLIENT_S *client, uint32_t id, int op,
+                                 uint32_t arg) {
+    uint64_t start_us = modem_rpc_now_us();
+    char text[RPC_TEXT_LEN];
+    char *metrics;
+    int status = 0;
+
+    text[0] = '\0';
+    switch (op) {
+      case MODEM_RPC_GET_STATE:
+        modem_rpc_state(text, sizeof(text));
+        break;
+      case MODEM_RPC_GET_LOAD:
+        status = modem_rpc_load(arg, text, sizeof(text));
+        break;
+      case MODEM_RPC_METRICS:
+        metrics = modem_rpc_metrics();
+        if (NULL == metrics) {
+            status = -ENOMEM;
+            break;
+        }
+        modem_rpc_respond(client, id, op, 0, start_us, metrics);
+        free(metrics);
+        return;
+      case MODEM_RPC_RESET:
+      case MODEM_RPC_ASSERT:
+      case MODEM_RPC_DUMP:
+        status = modem_rpc_queue(client, id, op, start_us);
+        if (status == 0)
+            return;
+        break;
+      default:
+        status = -EINVAL;
+        break;
+    }
+
+    if (status && text[0] == '\0')
+        snprintf(text, sizeof(text), "%s", strerror(-status));
+    modem_rpc_respond(client, id, op, status, start_us, text);
+}
+
+/* "Modem Request: <id> <op> [arg]" */
+static void modem_client_request_text(MODEM_CLIENT_S *client,
+                                      const char *text) {
+    char name[16] = {0};
+    unsigned int id = 0, arg = 0;
+    int op;
+
+    text = strchr(text, ':');
+    if (NULL == text || sscanf(text + 1, "%u %15s %u", &id, name, &arg) < 2) {
+        modem_rpc_respond(client, id, 0, -EINVAL, modem_rpc_now_us(),
+                          strerror(EINVAL));
+        return;
+    }
+
+    for (op = MODEM_RPC_OP_MAX - 1; op > 0; op--) {
+        if (!strcmp(name, s_rpcOps[op]))
+            break;
+    }
+    modem_client_request(client, id, op, arg);
+}
+
+/* modem control has run the request of token */
+void modem_client_request_done(uint32_t token, int status) {
+    RPC_PENDING_S pending;
+    int i;
+
+    pthread_mutex_lock(&s_writeMutex);
+    for (i = 0; i < RPC_PENDING_MAX; i++) {
+        if (s_rpcPending[i].token == token)
+            break;
+    }
+    if (token == 0 || i == RPC_PENDING_MAX) {
+        /* the client has gone */
+        pthread_mutex_unlock(&s_writeMutex);
+        return;
+    }
+    pending = s_rpcPending[i];
+    memset(&s_rpcPending[i], 0, sizeof(s_rpcPending[i]));
+    modem_rpc_respond(pending.client, pending.id, pending.op, status,
+                      pending.start_us, status ? strerror(-status) : "done");
+    pthread_mutex_unlock(&s_writeMutex);
+}
+
+/* append to the registry, with s_writeMutex held */
+static int modem_clients_insert(MODEM_CLIENT_S *client) {
+    MODEM_CLIENT_S **table;
+    int size;
+
+    if (s_clientNum == s_clientSize) {
+        size = s_clientSize ? s_clientSize * 2 : CLIENT_TABLE_INIT_SIZE;
+        table = realloc(s_clients, size * sizeof(MODEM_CLIENT_S *));
+        if (NULL == table)
+            return -1;
+        s_clients = table;
+        s_clientSize = size;
+    }
+
+    client->index = s_clientNum;
+    s_clients[s_clientNum++] = client;
+    return 0;
+}
+
+/* "rild:critical,1000:low" to s_priorities */
+static void modem_priority_parse(const char *map) {
+    char buf[PROPERTY_VALUE_MAX];
+    char *rule, *tier, *save = NULL;
+    CLIENT_PRIORITY_S *p;
+    int i;
+
+    strncpy(buf, map, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    s_priorityNum = 0;
+
+    for (rule = strtok_r(buf, ",", &save);
+         rule && s_priorityNum < CLIENT_PRIORITY_MAX;
+         rule = strtok_r(NULL, ",", &save)) {
+        tier = strchr(rule, ':');
+        if (NULL == tier)
             continue;
+        *tier++ = '\0';
+
+        p = &s_priorities[s_priorityNum];
+        memset(p, 0, sizeof(*p));
+        p->tier = -1;
+        for (i = 0; i < CLIENT_TIER_NUM; i++) {
+            if (!strcmp(tier, s_tierNames[i]))
+                p->tier = i;
+        }
+        if (p->tier < 0 || rule[0] == '\0') {
+            MODEM_LOGE("%s: bad rule %s:%s", __FUNCTION__, rule, tier);
+            continue;
+        }
+
+        if (rule[strspn(rule, "0123456789")] == '\0')
+            p->uid = atoi(rule);
+        else
+            strncpy(p->name, rule, CLIENT_NAME_LEN - 1);
+        s_priorityNum++;
+    }
+}
+
+/* base name of argv[0] of pid */
+static void modem_client_get_name(pid_t pid, char *name, int size) {
+    char path[32], cmdline[128];
+    char *base;
+    int fd, n;
+
+    name[0] = '\0';
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    n = read(fd, cmdline, sizeof(cmdline) - 1);
+    close(fd);
+    if (n <= 0)
+        return;
+    cmdline[n] = '\0';
+
+    base = strrchr(cmdline, '/');
+    strncpy(name, base ? base + 1 : cmdline, size - 1);
+    name[size - 1] = '\0';
+}
+
+/* a name rule wins over a uid rule */
+static int modem_client_get_tier(const MODEM_CLIENT_S *client) {
+    int i, tier = CLIENT_TIER_NORMAL;
+    bool by_uid = false;
+
+    for (i = 0; i < s_priorityNum; i++) {
+        if (s_priorities[i].name[0]) {
+            if (!strcmp(s_priorities[i].name, client->name))
+                return s_priorities[i].tier;
+        } else if (!by_uid && s_priorities[i].uid == client->uid) {
+            tier = s_priorities[i].tier;
+            by_uid = true;
+        }
+    }
+    return tier;
+}
+
+static void modem_client_add(int fd, bool framed) {
+    struct epoll_event ev;
+    MODEM_CLIENT_S *client;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    client = calloc(1, sizeof(MODEM_CLIENT_S));
+    if (NULL == client) {
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->index = -1;
+    client->framed = framed;
+    client->mask = MODEM_EVENT_MASK_ALL;
+    client->connect_time = time(NULL);
+    client->pid = -1;
+    client->uid = -1;
+    if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        client->pid = cred.pid;
+        client->uid = cred.uid;
+        modem_client_get_name(client->pid, client->name,
+                              sizeof(client->name));
+    }
+    client->tier = modem_client_get_tier(client);
+
+    pthread_mutex_lock(&s_writeMutex);
+    /* the broadcasts before it are not counted in the latency */
+    client->latency_seq = s_eventSeq;
+    /* refuse the new one, a connected client is never evicted */
+    if (s_clientNum >= MAX_CLIENT_NUM || modem_clients_insert(client)) {
+        MODEM_LOGE("%s: %d clients, refuse %d from pid %d", __FUNCTION__,
+                   s_clientNum, fd, client->pid);
+        pthread_mutex_unlock(&s_writeMutex);
+        close(fd);
+        free(client);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = client;
+    if (epoll_ctl(s_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        MODEM_LOGE("%s: epoll add %d failed, error: %s", __FUNCTION__, fd,
+                   strerror(errno));
+        modem_client_close(client);
+        pthread_mutex_unlock(&s_writeMutex);
+        return;
+    }
+    MODEM_LOGD("%s: client %d pid %d uid %d %s tier %s%s, %d clients",
+               __FUNCTION__, fd, client->pid, client->uid, client->name,
+               s_tierNames[client->tier], framed ? " framed" : "",
+               s_clientNum);
+
+    // infor client modem current state, as of the last broadcast
+    modem_client_reply_seq(client, modem_state_message(), MODEM_EVENT_STATE,
+                           s_eventSeq);
+    pthread_mutex_unlock(&s_writeMutex);
+}
+
+static void modem_clients_accept(MODEM_LISTEN_S *server) {
+    int n;
+
+    for (;;) {
+        n = accept4(server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                MODEM_LOGE("%s  accept error: %s\n", __FUNCTION__,
+                           strerror(errno));
+            return;
         }
         MODEM_LOGD("%s: accept client n=%d", __FUNCTION__, n);
-        for (index = 0; index < MAX_CLIENT_NUM; index++) {
-            if (s_clientFd[index] == -1) {
-                s_clientFd[index] = n;
-                write(s_notifypipe[1], "0", sizeof("0"));
-                MODEM_LOGD("%s: fill%d to client[%d]", __FUNCTION__, n, index);
-
-                // infor client modem current state
-                const char *modemState = NULL;
-                if (s_modemState == MODEMCON_STATE_OFFLINE) {
-                    modemState = "Modem State: Offline";
-                } else if (s_modemState == MODEMCON_STATE_ALIVE) {
-                    modemState = "Modem State: Alive";
-                } else if (s_modemState == MODEMCON_STATE_ASSERT) {
-                    modemState = "Modem State: Assert";
-                } else if (s_modemState == MODEMCON_STATE_RESET) {
-                    modemState = "Modem State: Reset";
-                } else {
-                    modemState = "Modem State: Unknown";
-                }
-                write(s_clientFd[index], modemState, strlen(modemState) + 1);
-                break;
-            }
-            /* if client_fd arrray is full, just fill the new socket to the
-             * last element */
-            if (index == MAX_CLIENT_NUM - 1) {
-                MODEM_LOGD("%s: client full, just fill %d to client[%d]",
-                            __FUNCTION__, n, index);
-                close(s_clientFd[index]);
-                s_clientFd[index] = n;
-                write(s_notifypipe[1], "0", 2);
-                break;
-            }
+        modem_client_add(n, server->framed);
+    }
+}
+
+/*
+ * send the kept broadcasts with seq >= from to client, with s_writeMutex
+ * held, they keep their seq and timestamp.
+ */
+static void modem_client_replay(MODEM_CLIENT_S *client, uint32_t from,
+                                uint32_t to) {
+    uint32_t first, seq;
+    MODEM_MSG_S *event, *msg;
+    char gap[64];
+
+    /* the oldest kept, seq 0 is never used */
+    first = s_eventSeq >= EVENT_REPLAY_LEN ? s_eventSeq - EVENT_REPLAY_LEN + 1
+                                           : 1;
+    if (from == 0)
+        from = 1;
+    /* the later ones were sent to the client already */
+    if (to == 0 || to > s_eventSeq)
+        to = s_eventSeq;
+    MODEM_LOGD("%s: client %d pid %d %u-%u, kept %u-%u", __FUNCTION__,
+               client->fd, client->pid, from, to, first, s_eventSeq);
+
+    if (from < first && from <= to) {
+        snprintf(gap, sizeof(gap), "%s Gap: %u-%u", MODEM_REPLAY, from,
+                 min(first - 1, to));
+        if (client->framed)
+            msg = modem_event_alloc(gap, strlen(gap) + 1, first,
+                                    MODEM_EVENT_REPLAY_GAP);
+        else
+            msg = modem_msg_alloc(gap, strlen(gap) + 1);
+        if (msg && modem_client_send(client, msg))
+            goto broken;
+        if (msg && msg->ref == 0)
+            free(msg);
+        from = first;
+    }
+
+    for (seq = from; seq <= to; seq++) {
+        event = s_eventRing[seq % EVENT_REPLAY_LEN];
+        if (!(client->mask & MODEM_EVENT_MASK(event->type)))
+            continue;
+
+        if (client->framed) {
+            msg = event;
+        } else {
+            msg = modem_msg_alloc(event->data + sizeof(struct modem_event_header),
+                                  event->size -
+                                  sizeof(struct modem_event_header));
+            if (NULL == msg)
+                return;
         }
+        if (modem_client_send(client, msg))
+            goto broken;
+        if (msg->ref == 0)
+            free(msg);
     }
-    close(s_notifypipe[1]);
-    s_notifypipe[1] = -1;
+    return;
+
+broken:
+    if (msg->ref == 0)
+        free(msg);
+    modem_client_close(client);
+}
 
-    close(s_fdModemCtrlRead);
-    s_fdModemCtrlRead = -1;
+/* "Modem Subscribe: alive,assert" to a mask */
+static uint32_t modem_subscribe_parse(const char *text) {
+    uint32_t mask = 0;
+    unsigned int i;
 
-    close(s_fdModemCtrlWrite);
-    s_fdModemCtrlWrite = -1;
+    text = strchr(text, ':');
+    if (NULL == text)
+        return MODEM_EVENT_MASK_ALL;
 
-    return NULL;
+    for (i = 0; i < sizeof(s_subscribeClasses) / sizeof(s_subscribeClasses[0]);
+         i++) {
+        if (strstr(text, s_subscribeClasses[i].name))
+            mask |= s_subscribeClasses[i].mask;
+    }
+    return mask;
+}
+
+/* with s_writeMutex held */
+static void modem_client_subscribe(MODEM_CLIENT_S *client, uint32_t mask) {
+    MODEM_LOGD("%s: client %d pid %d, mask 0x%x", __FUNCTION__, client->fd,
+               client->pid, mask);
+    client->mask = mask;
+}
+
+/*
+ * handle a framed record with s_writeMutex held, a command is taken
+ * as the legacy text, return its length or 0 if it isn't a command.
+ */
+static int modem_event_request(MODEM_CLIENT_S *client, char *buf, int size,
+                               char *controlinfo, int info_size) {
+    struct modem_event_header header;
+    struct modem_rpc_request request;
+    uint32_t mask, range[2] = {0, 0};
+
+    if (size < (int)sizeof(header))
+        return 0;
+    memcpy(&header, buf, sizeof(header));
+    if (header.version != MODEM_EVENT_VERSION ||
+        header.len > size - sizeof(header))
+        goto drop;
+
+    switch (header.type) {
+      case MODEM_EVENT_COMMAND:
+        size = min((int)header.len, info_size - 1);
+        memcpy(controlinfo, buf + sizeof(header), size);
+        controlinfo[size] = '\0';
+        return size;
+      case MODEM_EVENT_SUBSCRIBE:
+        if (header.len < sizeof(mask))
+            goto drop;
+        memcpy(&mask, buf + sizeof(header), sizeof(mask));
+        modem_client_subscribe(client, mask);
+        return 0;
+      case MODEM_EVENT_REPLAY:
+        if (header.len < sizeof(range[0]))
+            goto drop;
+        memcpy(range, buf + sizeof(header), min(header.len, sizeof(range)));
+        modem_client_replay(client, range[0], range[1]);
+        return 0;
+      case MODEM_EVENT_STATE_PAGE:
+        modem_client_send_page(client);
+        return 0;
+      case MODEM_EVENT_REQUEST:
+        if (header.len < sizeof(request))
+            goto drop;
+        memcpy(&request, buf + sizeof(header), sizeof(request));
+        modem_client_request(client, request.id, request.op, request.arg);
+        return 0;
+      default:
+        break;
+    }
+
+drop:
+    MODEM_LOGE("%s: drop record version %d, type %d, len %u", __FUNCTION__,
+               header.version, header.type, header.len);
+    return 0;
 }
 
-static void *modem_ctrl_read_thread(void) {
+static void modem_client_event(MODEM_CLIENT_S *client, uint32_t events) {
     char controlinfo[BUFFER_SIZE] = {0};
-    int readnum = -1;
-    int i = 0 , num = 0;
-    fd_set engpcFds;
-    int nengfds = 0;  // max engpc_fd;
-    int later_reset = 0;
-    int state = -1;
+    char record[sizeof(struct modem_event_header) + BUFFER_SIZE];
+    int readnum = 0;
+    int fd;
+
+    pthread_mutex_lock(&s_writeMutex);
+    /* closed since epoll_wait, freed after this batch */
+    fd = client->fd;
+    if (fd < 0) {
+        pthread_mutex_unlock(&s_writeMutex);
+        return;
+    }
+
+    /* the client reads again, send what's queued */
+    if ((events & EPOLLOUT) && modem_client_flush(client)) {
+        modem_client_close(client);
+        pthread_mutex_unlock(&s_writeMutex);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        pthread_mutex_unlock(&s_writeMutex);
+        return;
+    }
+
+    if ((events & EPOLLIN) && client->framed) {
+        do {
+            readnum = read(fd, record, sizeof(record));
+        } while (readnum < 0 && errno == EINTR);
+        /* nothing to dispatch, a bad record is dropped but the client is kept */
+        if (readnum > 0) {
+            client->recv_msgs++;
+            readnum = modem_event_request(client, record, readnum,
+                                          controlinfo, sizeof(controlinfo));
+            if (readnum == 0) {
+                readnum = -1;
+                errno = EAGAIN;
+            }
+        }
+        MODEM_LOGD("%s: after read %s", __FUNCTION__, controlinfo);
+    } else if (events & EPOLLIN) {
+        do {
+            readnum = read(fd, controlinfo, sizeof(controlinfo) - 1);
+        } while (readnum < 0 && errno == EINTR);
+        if (readnum > 0)
+            client->recv_msgs++;
+        MODEM_LOGD("%s: after read %s", __FUNCTION__, controlinfo);
+    }
+
+    /*
+     * eof or hangup, the pending data is read first and the
+     * hangup is reported again by the next epoll_wait.
+     */
+    if (readnum == 0 ||
+        (readnum < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        modem_client_close(client);
+    } else if (readnum > 0 && strstr(controlinfo, MODEM_CLIENT_STATS)) {
+        char *stats = modem_clients_stats();
+
+        if (stats)
+            modem_client_reply(client, stats, MODEM_EVENT_CLIENT_STATS);
+        free(stats);
+        readnum = 0;
+    } else if (readnum > 0 && strstr(controlinfo, MODEM_SUBSCRIBE)) {
+        modem_client_subscribe(client, modem_subscribe_parse(controlinfo));
+        readnum = 0;
+    } else if (readnum > 0 && strstr(controlinfo, MODEM_REPLAY)) {
+        char *seq = strchr(controlinfo, ':');
+        uint32_t from = 0, to = 0;
+
+        if (seq) {
+            from = strtoul(seq + 1, &seq, 10);
+            to = strtoul(seq, NULL, 10);
+        }
+        modem_client_replay(client, from, to);
+        readnum = 0;
+    } else if (readnum > 0 && strstr(controlinfo, MODEM_STATE_PAGE)) {
+        modem_client_send_page(client);
+        readnum = 0;
+    } else if (readnum > 0 && strstr(controlinfo, MODEM_REQUEST)) {
+        modem_client_request_text(client, controlinfo);
+        readnum = 0;
+    }
+    pthread_mutex_unlock(&s_writeMutex);
+
+    if (readnum > 0)
+        modem_ctrl_dispatch_message(controlinfo, readnum);
+}
+
+/* a non-blocking listen socket watched by the reactor */
+static int modem_listen_socket(MODEM_LISTEN_S *server, const char *name,
+                               int type) {
+    struct epoll_event ev;
+    int sfd;
 
+    sfd = socket_local_server(name, ANDROID_SOCKET_NAMESPACE_ABSTRACT, type);
+    if (sfd < 0) {
+        MODEM_LOGE("%s: cannot create local socket server %s, errno: %d, "
+                   "err: %s", __FUNCTION__, name, errno, strerror(errno));
+        return -1;
+    }
+    fcntl(sfd, F_SETFD, FD_CLOEXEC);
+    fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = server;
+    if (epoll_ctl(s_epollFd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        close(sfd);
+        return -1;
+    }
+    server->fd = sfd;
+    return 0;
+}
+
+void *modem_setup_clients_connect(void) {
+    int n, i;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
     pthread_condattr_t reset_attr;
+    pthread_attr_t worker_attr;
+    pthread_t worker_tid;
+    char prop[PROPERTY_VALUE_MAX] = {0};
+
+    property_get(MODEM_CLIENT_OVERFLOW_PROP, prop, "drop_oldest");
+    s_overflowDisconnect = !strcmp(prop, "disconnect");
+    MODEM_LOGD("%s: client queue overflow policy: %s", __FUNCTION__, prop);
+
+    property_get(MODEM_CLIENT_PRIORITY_PROP, prop,
+                 MODEM_CLIENT_PRIORITY_DEFAULT);
+    modem_priority_parse(prop);
+    MODEM_LOGD("%s: client priority: %s, %d rules", __FUNCTION__, prop,
+               s_priorityNum);
+
     pthread_condattr_init(&reset_attr);
     pthread_condattr_setclock(&reset_attr, CLOCK_MONOTONIC);
     pthread_cond_init(&s_dumpCond, &reset_attr);
 
+    pthread_attr_init(&worker_attr);
+    pthread_attr_setdetachstate(&worker_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&worker_tid, &worker_attr, modem_side_effect_worker,
+                       NULL) == 0)
+        s_sideEffectWorker = true;
+    else
+        MODEM_LOGE("%s: side effect worker create error", __FUNCTION__);
+    pthread_attr_destroy(&worker_attr);
+
+    s_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (s_epollFd < 0) {
+        MODEM_LOGE("%s: epoll_create1 failed, error: %s", __FUNCTION__,
+                   strerror(errno));
+        return NULL;
+    }
+
+    if (modem_listen_socket(&s_listen, SOCKET_NAME_MODEMD, SOCK_STREAM)) {
+        close(s_epollFd);
+        s_epollFd = -1;
+        return NULL;
+    }
+    /* the legacy socket works without the framed one */
+    modem_listen_socket(&s_eventListen, MODEM_EVENT_SOCKET, SOCK_SEQPACKET);
+
     MODEM_LOGD("%s: enter", __FUNCTION__);
     for (;;) {
-        FD_ZERO(&engpcFds);
-        nengfds = s_notifypipe[0] + 1;
-        FD_SET(s_notifypipe[0], &engpcFds);
-        for (i = 0; i < MAX_CLIENT_NUM; i++) {
-            if (s_clientFd[i] != -1) {
-                FD_SET(s_clientFd[i], &engpcFds);
-                if (s_clientFd[i] >= nengfds)
-                    nengfds = s_clientFd[i] + 1;
-            }
-        }
-        MODEM_LOGD("%s: begin select", __FUNCTION__);
-        num = select(nengfds, &engpcFds, NULL, NULL, NULL);
-        MODEM_LOGD("%s: after select n = %d",  __FUNCTION__, num);
-        if (num > 0 && (FD_ISSET(s_notifypipe[0], &engpcFds))) {
-            char buf[32] = {0};
-            memset(buf, 0, sizeof(buf));
-            read(s_notifypipe[0], buf, sizeof(buf) - 1);
-            MODEM_LOGD("%s: client cnct to modemd num = %d, buf = %s",
-                        __FUNCTION__, num, buf);
-            if (num == 1) {
-                continue;
-            }
+        n = epoll_wait(s_epollFd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                MODEM_LOGE("%s: epoll_wait error: %s", __FUNCTION__,
+                           strerror(errno));
+            continue;
         }
-        for (i = 0; (i < MAX_CLIENT_NUM) && (num > 0); i++) {
-            int nfd = s_clientFd[i];
-            if (nfd != -1 && FD_ISSET(nfd, &engpcFds)) {
-                num--;
-                MODEM_LOGD("%s: begin read ", __FUNCTION__);
-                memset(controlinfo, 0, sizeof(controlinfo));
-                readnum =  read(nfd, controlinfo, sizeof(controlinfo));
-                MODEM_LOGD("%s: after read %s", __FUNCTION__, controlinfo);
-                if (readnum <= 0) {
-                    close(s_clientFd[i]);
-                    s_clientFd[i] = -1;
-                } else {
-                  /* get dump state. */
-                  if (strstr(controlinfo, "SLOGMODEM DUMP BEGIN")) {
-                    state = DUMP_BEGIN;
-                  } else if (strstr(controlinfo, "SLOGMODEM DUMP ONGOING")) {
-                    state = DUMP_GOING;
-                  } else if (strstr(controlinfo, "SLOGMODEM DUMP COMPLETE")) {
-                    state = DUMP_COMPLETE;
-                  }
-
-                  if (strstr(controlinfo, "Modem Blocked")) {
-                    later_reset = dispatch_modem_blocked(s_fdModemCtrlWrite);
-                  } else if (strstr(controlinfo, "AGDSP Assert")) {
-                    modem_write_data_to_clients(controlinfo, readnum);
-                  } else if (DUMP_COMPLETE == state) {
-                        pthread_mutex_lock(&s_dumpMtx);
-                        pthread_cond_signal(&s_dumpCond);
-                        pthread_mutex_unlock(&s_dumpMtx);
-			MODEM_LOGD("send dump complete.");
-                        /* modem block, after dump complete, reset modem. */
-                        if (later_reset) {
-                          MODEM_LOGD("%s: block, later reset.", __FUNCTION__);
-                          later_reset = false;
-                          if (s_fdModemCtrlWrite >= 0)
-                           write(s_fdModemCtrlWrite, "Modem Reset", sizeof("Modem Reset"));
-                        }
-                    }
-                }
-            }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &s_listen ||
+                events[i].data.ptr == &s_eventListen)
+                modem_clients_accept(events[i].data.ptr);
+            else
+                modem_client_event(events[i].data.ptr, events[i].events);
         }
+        modem_clients_reap();
     }
-    close(s_notifypipe[0]);
-    s_notifypipe[0] = -1;
+
+    close(s_epollFd);
+    s_epollFd = -1;
+
+    close(s_listen.fd);
+    s_listen.fd = -1;
+    if (s_eventListen.fd >= 0)
+        close(s_eventListen.fd);
+    s_eventListen.fd = -1;
+
     return NULL;
 }
 
+static void modem_ctrl_dispatch_message(char *controlinfo, int readnum) {
+    static int state = -1;
+    int later_reset = 0;
+
+    /* get dump state. */
+    if (strstr(controlinfo, "SLOGMODEM DUMP BEGIN")) {
+      state = DUMP_BEGIN;
+    } else if (strstr(controlinfo, "SLOGMODEM DUMP ONGOING")) {
+      state = DUMP_GOING;
+    } else if (strstr(controlinfo, "SLOGMODEM DUMP COMPLETE")) {
+      state = DUMP_COMPLETE;
+    }
+
+    if (strstr(controlinfo, "Modem Blocked")) {
+      /* it sleeps and runs commands, keep it off the reactor */
+      pthread_mutex_lock(&s_dumpMtx);
+      s_blockRunning = true;
+      s_blockDumped = false;
+      pthread_mutex_unlock(&s_dumpMtx);
+      modem_side_effect_post(SIDE_EFFECT_BLOCK);
+    } else if (strstr(controlinfo, "AGDSP Assert")) {
+      modem_write_data_to_clients(controlinfo, readnum);
+    } else if (DUMP_COMPLETE == state) {
+      pthread_mutex_lock(&s_dumpMtx);
+      pthread_cond_signal(&s_dumpCond);
+      if (s_blockRunning) {
+        s_blockDumped = true;
+      } else {
+        later_reset = s_blockLaterReset;
+        s_blockLaterReset = false;
+      }
+      pthread_mutex_unlock(&s_dumpMtx);
+      MODEM_LOGD("send dump complete.");
+      /* modem block, after dump complete, reset modem. */
+      if (later_reset) {
+        MODEM_LOGD("%s: block, later reset.", __FUNCTION__);
+        modem_cmd_post(MODEM_CMD_RESET, MODEM_CMD_FROM_DUMP);
+      }
+    }
+}
+
 /* control nvitemd  para: 0, stop; !0 , start */
 static void control_nvitemd(int isStart) {
     MODEM_LOGD("control nvitemd! isStart %d", isStart);
@@ -286,11 +1588,11 @@ static void control_nvitemd(int isStart) {
 }
 
 // start only when need to dump after md assert
-static void *write_reset_to_modem_ctrl(void *ctrlFd) {
-    int fd = *((int *)ctrlFd);
-    int ret = -1;
+static void *write_reset_to_modem_ctrl(void *param) {
     struct timespec tv;
 
+    (void)param;
+
     clock_gettime(CLOCK_MONOTONIC, &tv);
     // wait 5 min for timeout
     tv.tv_sec += TIME_FOR_MD_DUMP;
@@ -304,20 +1606,25 @@ static void *write_reset_to_modem_ctrl(void *ctrlFd) {
 
     MODEM_LOGD("dump complete, Write Prepare Reset to modem_control.\n");
 
-    ret = write(fd, "Prepare Reset", sizeof("Prepare Reset"));
-    if (ret <= 0) {
-        MODEM_LOGE("write_reset_to_modem_ctrl: write reset failed. errno: %d, error: %s",
-                    errno, strerror(errno));
-    }
+    modem_cmd_post(MODEM_CMD_PREPARE_RESET, MODEM_CMD_FROM_DUMP);
 
     return NULL;
 }
 
+static uint64_t modem_connect_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void readIMEI() {
     int ret = -1;
     int fd = -1;
-    int j = 0;
+    int j = 0, len = 0;
     fd_set rfds;
+    struct timeval tv;
+    uint64_t now, deadline;
     char *device = "/dev/stty_lte2";
     char *atCmd = "AT+CGSN";
     char prop[PROPERTY_VALUE_MAX] = {0};
@@ -346,24 +1653,42 @@ static void readIMEI() {
     }
 
     MODEM_LOGD("write done and read start");
-    //usleep(100*1000);
     memset(prop, 0, sizeof(prop));
 
-    FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
-    ret = select(fd + 1, &rfds, NULL, NULL, NULL);
+    /* the reply may come in pieces, read it until OK or the deadline */
+    deadline = modem_connect_now_ms() + IMEI_READ_TIMEOUT_MS;
+    while (len < (int)sizeof(prop) - 1 && !strstr(prop, "OK")
+           && !strstr(prop, "ERROR")) {
+        now = modem_connect_now_ms();
+        if (now >= deadline) {
+            MODEM_LOGE("%s: read %d timeout, got: %s", __func__, fd, prop);
+            break;
+        }
+        tv.tv_sec = (deadline - now) / 1000;
+        tv.tv_usec = (deadline - now) % 1000 * 1000;
+
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        ret = select(fd + 1, &rfds, NULL, NULL, &tv);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            continue;
 
-    if (ret <= 0) {
-        MODEM_LOGD("read error hanppend!");
-        return;
+        ret = read(fd, prop + len, sizeof(prop) - 1 - len);
+        if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (ret <= 0) {
+            MODEM_LOGE("%s: read %d return %d, errno = %s", __func__, fd, ret,
+                        strerror(errno));
+            break;
+        }
+        len += ret;
+        prop[len] = '\0';
     }
 
-    do {
-        ret = read(fd, prop, sizeof(prop) - 1);
-    } while (ret < 0 && errno == EINTR);
-    if (ret <= 0) {
-        MODEM_LOGE("%s: read %d return %d, errno = %s", __func__, fd, ret,
-                    strerror(errno));
+    if (!strstr(prop, "OK")) {
+        MODEM_LOGE("%s: no imei, read: %s", __func__, prop);
         close(fd);
         return;
     }
@@ -383,14 +1708,11 @@ static void readIMEI() {
     close(fd);
 }
 
-static void modem_ctrl_process_message(void *buf, int size) {
-    const char *message = (const char *)buf;
-
-	MODEM_LOGD("process_message(%d) : %s",  size, message);
+static void modem_side_effect_run(int effect) {
+    MODEM_LOGD("%s: %d", __FUNCTION__, effect);
 
-    if (strstr(message, "Modem Alive")) {
+    if (effect == SIDE_EFFECT_ALIVE) {
         char prop[PROPERTY_VALUE_MAX] = {0};
-        s_modemState = MODEMCON_STATE_ALIVE;
         /* start nvitemd */
         control_nvitemd(1);
 
@@ -401,65 +1723,122 @@ static void modem_ctrl_process_message(void *buf, int size) {
             MODEM_LOGD("wifionly to start read imei");
             readIMEI();
         }
-    } else if (strstr(message, "Modem Assert")) {
-        if (strstr(message, "P-ARM Modem Assert")) {
-            s_needResetModem = false;
-        }
+    } else if (effect == SIDE_EFFECT_ASSERT) {
+        /* stop nvitemd */
+        control_nvitemd(0);
 
-        if (s_needResetModem) {
-            s_modemState = MODEMCON_STATE_ASSERT;
-            /* stop nvitemd */
-            control_nvitemd(0);
-
-            int isReset = 0, isDump = 0;
-            char prop[PROPERTY_VALUE_MAX] = {0};
-            property_get(MODEM_RESET_PROP, prop, "0");
-            isReset = atoi(prop);
-			property_get(MODEM_SAVE_DUMP_PROP, prop, "0");
-            isDump = atoi(prop);
-            MODEM_LOGD("reload modem: %d, dump: %d", isReset, isDump);
-            // if it need save dump, it will not reset when receive modem assert
-            // it will reset when receive SLOGMODEM DUMP COMPLETE or timeout
-            if (isReset) {
-
-                if (isDump) {
-                    pthread_t reset_tid;
-                    pthread_attr_t reset_attr;
-
-                    pthread_attr_init(&reset_attr);
-                    pthread_attr_setdetachstate(&reset_attr, PTHREAD_CREATE_DETACHED);
-                    pthread_create(&reset_tid, &reset_attr,
-                            (void *)write_reset_to_modem_ctrl, &s_fdModemCtrlWrite);
-                } else {
-                    write(s_fdModemCtrlWrite, "Prepare Reset", sizeof("Prepare Reset"));
-                }
+        int isReset = 0, isDump = 0;
+        char prop[PROPERTY_VALUE_MAX] = {0};
+        property_get(MODEM_RESET_PROP, prop, "0");
+        isReset = atoi(prop);
+        property_get(MODEM_SAVE_DUMP_PROP, prop, "0");
+        isDump = atoi(prop);
+        MODEM_LOGD("reload modem: %d, dump: %d", isReset, isDump);
+        // if it need save dump, it will not reset when receive modem assert
+        // it will reset when receive SLOGMODEM DUMP COMPLETE or timeout
+        if (isReset) {
+
+            if (isDump) {
+                pthread_t reset_tid;
+                pthread_attr_t reset_attr;
+
+                pthread_attr_init(&reset_attr);
+                pthread_attr_setdetachstate(&reset_attr, PTHREAD_CREATE_DETACHED);
+                pthread_create(&reset_tid, &reset_attr,
+                        (void *)write_reset_to_modem_ctrl, NULL);
+            } else {
+                modem_cmd_post(MODEM_CMD_PREPARE_RESET, MODEM_CMD_FROM_ASSERT);
             }
-        } else {
-            s_needResetModem = true;
         }
-    } else if (strstr(message, "Modem Reset")) {
+    } else if (effect == SIDE_EFFECT_RESET) {
         /* stop nvitemd */
         control_nvitemd(0);
-        write(s_fdModemCtrlWrite, "Modem Reset", sizeof("Modem Reset"));
+        modem_cmd_post(MODEM_CMD_RESET, MODEM_CMD_FROM_RESET);
+    } else if (effect == SIDE_EFFECT_BLOCK) {
+        int later_reset = dispatch_modem_blocked();
+        int reset_now;
+
+        /* the dump may complete while it waits */
+        pthread_mutex_lock(&s_dumpMtx);
+        reset_now = later_reset && s_blockDumped;
+        s_blockLaterReset = later_reset && !s_blockDumped;
+        s_blockRunning = false;
+        s_blockDumped = false;
+        pthread_mutex_unlock(&s_dumpMtx);
+        if (reset_now) {
+            MODEM_LOGD("%s: block, dump completed, reset.", __FUNCTION__);
+            modem_cmd_post(MODEM_CMD_RESET, MODEM_CMD_FROM_DUMP);
+        }
+    }
+}
+
+static void *modem_side_effect_worker(void *param) {
+    int effect;
+
+    (void)param;
+    for (;;) {
+        pthread_mutex_lock(&s_sideEffectMtx);
+        while (s_sideEffectNum == 0)
+            pthread_cond_wait(&s_sideEffectCond, &s_sideEffectMtx);
+        effect = s_sideEffects[s_sideEffectHead];
+        s_sideEffectHead = (s_sideEffectHead + 1) % SIDE_EFFECT_QUEUE_LEN;
+        s_sideEffectNum--;
+        pthread_mutex_unlock(&s_sideEffectMtx);
+
+        modem_side_effect_run(effect);
+    }
+
+    return NULL;
+}
+
+static void modem_side_effect_post(int effect) {
+    /* no worker, run it here as before */
+    if (!s_sideEffectWorker) {
+        modem_side_effect_run(effect);
+        return;
+    }
+
+    pthread_mutex_lock(&s_sideEffectMtx);
+    if (s_sideEffectNum == SIDE_EFFECT_QUEUE_LEN) {
+        MODEM_LOGE("%s: queue full, drop %d", __FUNCTION__, effect);
+    } else {
+        s_sideEffects[(s_sideEffectHead + s_sideEffectNum)
+                      % SIDE_EFFECT_QUEUE_LEN] = effect;
+        s_sideEffectNum++;
+        pthread_cond_signal(&s_sideEffectCond);
+    }
+    pthread_mutex_unlock(&s_sideEffectMtx);
+}
+
+/* only classify it, the broadcast doesn't wait for the side effects */
+static void modem_ctrl_process_message(void *buf, int size) {
+    const char *message = (const char *)buf;
+
+	MODEM_LOGD("process_message(%d) : %s",  size, message);
+
+    if (strstr(message, "Modem Alive")) {
+        modem_side_effect_post(SIDE_EFFECT_ALIVE);
+    } else if (strstr(message, "P-ARM Modem Assert")) {
+        /* P-ARM Modem Assert doesn't need to reset modem */
+    } else if (strstr(message, "Modem Assert")) {
+        modem_side_effect_post(SIDE_EFFECT_ASSERT);
+    } else if (strstr(message, "Modem Reset")) {
+        modem_side_effect_post(SIDE_EFFECT_RESET);
     }
 }
 
-static int dispatch_modem_blocked(int blockFd) {
-    int ret, isReset, isDump, isWait = 0;;
+static int dispatch_modem_blocked(void) {
+    int ret, isReset, isDump, isWait = 0, isAlive;
     int loopFd;
     char loopDev[PROPERTY_VALUE_MAX] = {0};
     char prop[PROPERTY_VALUE_MAX], buffer[BUFFER_SIZE] = {0};
     char atStr[32] = "AT\r";
 
-    ret = write(blockFd, "Modem Blocked", sizeof("Modem Blocked"));
-
-    pthread_mutex_lock(&s_writeMutex);
-    if (s_modemState != MODEMCON_STATE_ALIVE) {
-        pthread_mutex_unlock(&s_writeMutex);
+    /* only the first block of an alive modem, before modem control sees it */
+    isAlive = modem_state_transit(MODEM_STATE_ALIVE, MODEM_STATE_BLOCK);
+    modem_cmd_post(MODEM_CMD_BLOCKED, MODEM_CMD_FROM_BLOCK);
+    if (!isAlive)
         return 0;
-    }
-    s_modemState = MODEMCON_STATE_ASSERT;
-    pthread_mutex_unlock(&s_writeMutex);
     system("echo load_modem_img >/sys/power/wake_lock");
     s_wakeLocking = true;
 
@@ -515,11 +1894,7 @@ RAW_RESET:
 		  isWait = 1;
 		} else {
 		  MODEM_LOGD("%s: reset is enabled, reload modem...", __func__);
-		  if (blockFd >= 0) {
-			ret = write(blockFd, "Modem Reset", sizeof("Modem Reset"));
-		  }
-		  MODEM_LOGD("write sfd: %d, ret: %d, errno: %s", blockFd, ret,
-					  strerror(errno));
+		  modem_cmd_post(MODEM_CMD_RESET, MODEM_CMD_FROM_BLOCK);
 		}
     } else {
         MODEM_LOGD("%s: reset is not enabled , not reset", __func__);
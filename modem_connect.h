@@ -6,8 +6,12 @@
 #ifndef MODEM_CONNECT_H_
 #define MODEM_CONNECT_H_
 
+#include <stdint.h>
+
 int modem_write_data_to_clients(void *buf, int size);
-int modem_read_data_from_clients(void *buf, int size);
+int modem_notify_clients(void *buf, int size);
 void *modem_setup_clients_connect(void);
+/* respond to the client request of token, status is 0 or -errno */
+void modem_client_request_done(uint32_t token, int status);
 
 #endif
@@ -11,8 +11,10 @@
 #include <sys/time.h>
 
 #include "modem_control.h"
+#include "modem_cmd.h"
 #include "modem_connect.h"
 #include "modem_load.h"
+#include "modem_state.h"
 
 #define BM_DEV "/dev/sprd_bm"
 #define DMC_MPU "/dev/dmc_mpu"
@@ -43,10 +45,14 @@ enum sci_bm_cmd_index {
 
 static int g_modem_type;
 static int wait_modem_reset;
-static int g_modem_state;
 
 static struct itimerval s_wait_alive_timer;
 
+/* images may be loaded concurrently, count the nested disable requests */
+static pthread_mutex_t s_bm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_bm_disable_cnt;
+static int s_dmc_disable_cnt;
+
 static void modem_ctrl_try_read_modem_alive(void)
 {
   struct timeval timeout;
@@ -213,6 +219,26 @@ void modem_ctrl_enable_wake_lock(bool bEnable, const char *pos) {
   close(fd);
 }
 
+/*
+ * only the first disable and the last enable need to touch the device,
+ * return true if this request should be passed to the device.
+ */
+static bool modem_ctrl_hold_disable(int *cnt, bool bEnable) {
+  bool pass;
+
+  pthread_mutex_lock(&s_bm_mutex);
+  if (bEnable) {
+    if (*cnt > 0)
+      (*cnt)--;
+    pass = (*cnt == 0);
+  } else {
+    pass = ((*cnt)++ == 0);
+  }
+  pthread_mutex_unlock(&s_bm_mutex);
+
+  return pass;
+}
+
 void modem_ctrl_enable_busmonitor(bool bEnable) {
   int fd;
   int param;
@@ -222,6 +248,9 @@ void modem_ctrl_enable_busmonitor(bool bEnable) {
   /* some device unsupport, if failed, just return */
   if (b_failed) return;
 
+  if (!modem_ctrl_hold_disable(&s_bm_disable_cnt, bEnable))
+    return;
+
   fd = open(BM_DEV, O_RDWR);
   if (fd < 0) {
     b_failed = 1;
@@ -248,6 +277,9 @@ void modem_ctrl_enable_dmc_mpu(bool bEnable) {
   /* some device unsupport, if failed, just return */
   if (b_failed) return;
 
+  if (!modem_ctrl_hold_disable(&s_dmc_disable_cnt, bEnable))
+    return;
+
   fd = open(DMC_MPU, O_RDWR);
   if (fd < 0) {
     b_failed = 1;
@@ -465,13 +497,13 @@ bool modem_ctrl_get_alive_dev(char *alive_dev, int size) {
 
 void modem_ctrl_set_modem_state(int state)
 {
-  g_modem_state = state;
-  MODEM_LOGD("%s: g_modem_state = %d\n", __FUNCTION__, g_modem_state);
+  modem_state_set(state);
+  MODEM_LOGD("%s: modem state = %d\n", __FUNCTION__, state);
 }
 
 int modem_ctrl_get_modem_state(void)
 {
-  return g_modem_state;
+  return modem_state_get();
 }
 
 void modem_ctrl_reboot_all_system(void) {
@@ -564,25 +596,99 @@ int modem_ctrl_boot_modem (void) {
   return 0;
 }
 
+/* reload modem, the external one is rebooted unless modem only is set */
+static void modem_ctrl_reset_modem(void) {
+#ifdef FEATURE_EXTERNAL_MODEM
+  char prop[PROPERTY_VALUE_MAX] = {0};
+#endif
+
+  modem_ctrl_stop_wait_alive_timer();
+#ifdef FEATURE_EXTERNAL_MODEM
+  property_get(MODEM_REBOOT_MODEMONLY, prop, "0");
+  if (!atoi(prop))
+    modem_ctrl_reboot_external_modem();
+  else
+    load_modem_img(LOAD_MODEM_IMG);
+#else
+  load_modem_img(LOAD_MODEM_IMG);
+#endif
+  modem_ctrl_start_wait_alive_timer();
+}
+
+/* the reset of a client request, in its own thread */
+static int modem_ctrl_reset_job(LOAD_JOB_S *job) {
+  (void)job;
+
+  modem_ctrl_enable_wake_lock(1, __FUNCTION__);
+  modem_ctrl_reset_modem();
+  modem_ctrl_enable_wake_lock(0, __FUNCTION__);
+  return 0;
+}
+
+static void modem_ctrl_reset_done(LOAD_JOB_S *job) {
+  modem_client_request_done((uint32_t)(uintptr_t)job->data, job->ret);
+}
+
+/* the response of the request is sent when its job ends */
+#define MODEM_REQUEST_PENDING 1
+
+/* a client request, whatever the state is, 0, -errno or pending */
+static int modem_ctrl_run_request(const modem_cmd *cmd) {
+  char prop[PROPERTY_VALUE_MAX] = {0};
+
+  switch (cmd->type) {
+    case MODEM_CMD_DUMP:
+      property_get(MODEM_SAVE_DUMP_PROP, prop, "0");
+      if (!atoi(prop))
+        return -EPERM;
+      /* slogmodem saves the dump of the assert */
+      /* fall through */
+    case MODEM_CMD_ASSERT:
+      if (MODEM_STATE_ALIVE != modem_ctrl_get_modem_state())
+        return -EAGAIN;
+      modem_load_assert_modem();
+      return 0;
+    case MODEM_CMD_RESET:
+      property_get(MODEM_RESET_PROP, prop, "0");
+      if (!atoi(prop))
+        return -EPERM;
+      /* the listener goes on, a newer reset preempts this load */
+      modem_load_job_async(NULL, modem_ctrl_reset_job, modem_ctrl_reset_done,
+                           (void *)(uintptr_t)cmd->token);
+      return MODEM_REQUEST_PENDING;
+    default:
+      return -EINVAL;
+  }
+}
+
 void *modem_ctrl_listen_clients(void *param) {
-  char buf[MAX_ASSERT_INFO_LEN] = {0};
-  int cnt = 0;
+  modem_cmd cmd;
+  int cnt = 0, state, ret;
   bool reboot_modem_only = false;
   char prop[PROPERTY_VALUE_MAX] = {0};
 
   MODEM_LOGD("%s: start listen clients...\n", __FUNCTION__);
 
   while (1) {
-    cnt = modem_read_data_from_clients(buf, sizeof(buf));
-    if (cnt <= 0) {
+    if (modem_cmd_wait(&cmd) < 0) {
       sleep(1);
       continue;
     }
-    MODEM_LOGD("%s: read cnt= %d, str= %s", __FUNCTION__, cnt, buf);
+    MODEM_LOGD("%s: %s from %s, queued %llums", __FUNCTION__,
+               modem_cmd_name(cmd.type), modem_cmd_origin_name(cmd.origin),
+               (unsigned long long)(modem_cmd_now_ms() - cmd.time_ms));
     /* get wake_lock */
     modem_ctrl_enable_wake_lock(1, __FUNCTION__);
 
-    if (strstr(buf, MODEM_BLOCK)) {
+    if (MODEM_CMD_FROM_CLIENT == cmd.origin) {
+      ret = modem_ctrl_run_request(&cmd);
+      if (MODEM_REQUEST_PENDING != ret)
+        modem_client_request_done(cmd.token, ret);
+      modem_ctrl_enable_wake_lock(0, __FUNCTION__);
+      continue;
+    }
+
+    if (MODEM_CMD_BLOCKED == cmd.type) {
       int isDump;
 
       modem_ctrl_set_modem_state(MODEM_STATE_BLOCK);
@@ -595,29 +701,21 @@ void *modem_ctrl_listen_clients(void *param) {
         modem_load_assert_modem();
     }
 
-    if (MODEM_STATE_BLOCK != g_modem_state
-        && MODEM_STATE_ASSERT != g_modem_state
-        && MODEM_STATE_RESET != g_modem_state) {
-      MODEM_LOGD("state(%d) not block or assert skip it!", g_modem_state);
+    state = modem_ctrl_get_modem_state();
+    if (MODEM_STATE_BLOCK != state
+        && MODEM_STATE_ASSERT != state
+        && MODEM_STATE_RESET != state) {
+      MODEM_LOGD("state(%d) not block or assert skip it!", state);
       continue;
     }
 
-    if (strstr(buf, MODEM_RESET)) {
-       modem_ctrl_stop_wait_alive_timer();
-#ifdef FEATURE_EXTERNAL_MODEM
-        memset(prop, 0, sizeof(prop));
-        property_get(MODEM_REBOOT_MODEMONLY, prop, "0");
-        reboot_modem_only = atoi(prop);
-        if (!reboot_modem_only)
-         modem_ctrl_reboot_external_modem();
-        else
-          load_modem_img(LOAD_MODEM_IMG);
-#else
-        load_modem_img(LOAD_MODEM_IMG);
-#endif
-        modem_ctrl_start_wait_alive_timer();
+    if (MODEM_CMD_RESET == cmd.type) {
+      modem_ctrl_reset_modem();
     }
-    else if (strstr(buf, PREPARE_RESET)) {
+    else if (MODEM_CMD_PREPARE_RESET == cmd.type) {
+     /* a reload follows, the in-flight load is pointless now */
+     modem_load_cancel(PREPARE_RESET);
+
      /* miniap panic, don't wait modem reset, just load all external image */
 #ifdef FEATURE_EXTERNAL_MODEM
      if (b_miniap_panic) {
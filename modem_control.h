@@ -55,6 +55,8 @@
 #define MODEM_ASSERT "Modem Assert"
 #define MODEM_BLOCK "Modem Blocked"
 #define MODEM_NOT_ALIVE "Modem Assert: modem not alive!"
+#define MODEM_LOAD_PROGRESS "Modem Load Progress"
+#define MODEM_LOAD_DONE "Modem Load Done"
 
 #define DSP_HUNG "HUNG"
 
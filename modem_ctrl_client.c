@@ -0,0 +1,477 @@
+/*
+ *  modem_ctrl_client.c - libmodemctrl, the client side of modemd.
+ *
+ *  The socket and the reconnect timer are in an epoll fd which is
+ *  given to the caller, so its event loop only sees one fd, whatever
+ *  state the connection is in.
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#define LOG_TAG "libmodemctrl"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <log/log.h>
+
+#include "modem_ctrl_client.h"
+
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 5000
+/* records handled by one dispatch, the rest keep the fd readable */
+#define DISPATCH_MAX_RECORD 32
+/* records read while waiting for the page reply */
+#define STATE_PAGE_MAX_RECORD 16
+
+/* epoll data */
+enum {
+  CLIENT_EV_SOCKET = 0,
+  CLIENT_EV_TIMER
+};
+
+struct modem_ctrl_client {
+  int epfd;             /* given to the caller */
+  int sfd;              /* -1 while not connected */
+  int tfd;              /* reconnect timer */
+  uint32_t mask;
+  unsigned int flags;
+  modem_ctrl_event_cb on_event;
+  modem_ctrl_conn_cb on_conn;
+  modem_ctrl_response_cb on_response;
+  void *cookie;
+  bool connected;
+  bool synced;          /* got the state of a connection */
+  uint32_t last_seq;    /* newest broadcast got */
+  uint32_t request_id;  /* of the last request */
+  int backoff_ms;
+  struct modem_state_page *page;
+};
+
+static socklen_t client_make_addr(struct sockaddr_un *addr, const char *name) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  /* abstract namespace, as socket_local_server() of modemd */
+  strncpy(addr->sun_path + 1, name, sizeof(addr->sun_path) - 2);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+}
+
+static int client_send_record(int fd, int type, const void *data,
+                              uint32_t len) {
+  char record[MODEM_EVENT_MAX_RECORD];
+  struct modem_event_header header;
+
+  if (len > MODEM_EVENT_MAX_PAYLOAD)
+    return -1;
+
+  memset(&header, 0, sizeof(header));
+  header.version = MODEM_EVENT_VERSION;
+  header.type = type;
+  header.len = len;
+  memcpy(record, &header, sizeof(header));
+  if (len)
+    memcpy(record + sizeof(header), data, len);
+
+  if (send(fd, record, sizeof(header) + len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+    return -1;
+  return 0;
+}
+
+/* one record, *pfd gets the fd passed with it or -1 */
+static int client_recv_record(int fd, char *record, int size, int *pfd) {
+  char cmsgbuf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr mh;
+  struct iovec iov;
+  int n;
+
+  iov.iov_base = record;
+  iov.iov_len = size - 1;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cmsgbuf;
+  mh.msg_controllen = sizeof(cmsgbuf);
+
+  *pfd = -1;
+  do {
+    n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return n;
+
+  cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(pfd, CMSG_DATA(cmsg), sizeof(int));
+  /* the payload is NUL terminated, even if it's truncated */
+  record[n] = '\0';
+  return n;
+}
+
+static struct modem_state_page *client_map_page(int fd) {
+  struct modem_state_page *page;
+
+  page = mmap(NULL, MODEM_STATE_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED)
+    return NULL;
+
+  if (page->magic != MODEM_STATE_PAGE_MAGIC ||
+      page->version != MODEM_STATE_PAGE_VERSION) {
+    munmap(page, MODEM_STATE_PAGE_SIZE);
+    return NULL;
+  }
+  return page;
+}
+
+static void client_unmap_page(modem_ctrl_client *client) {
+  if (client->page) {
+    munmap(client->page, MODEM_STATE_PAGE_SIZE);
+    client->page = NULL;
+  }
+}
+
+static void client_arm_timer(modem_ctrl_client *client, int ms) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  /* 0 would disarm it */
+  if (ms == 0)
+    its.it_value.tv_nsec = 1;
+  timerfd_settime(client->tfd, 0, &its, NULL);
+}
+
+static void client_retry(modem_ctrl_client *client) {
+  client_arm_timer(client, client->backoff_ms);
+  client->backoff_ms = client->backoff_ms * 2 > RECONNECT_MAX_MS
+                       ? RECONNECT_MAX_MS : client->backoff_ms * 2;
+}
+
+static void client_disconnect(modem_ctrl_client *client) {
+  bool connected = client->connected;
+
+  if (client->sfd >= 0) {
+    epoll_ctl(client->epfd, EPOLL_CTL_DEL, client->sfd, NULL);
+    close(client->sfd);
+    client->sfd = -1;
+  }
+  client->connected = false;
+  client_unmap_page(client);
+  client_retry(client);
+
+  if (connected && client->on_conn)
+    client->on_conn(client->cookie, 0);
+}
+
+static void client_connect(modem_ctrl_client *client) {
+  struct epoll_event ev;
+  struct sockaddr_un addr;
+  socklen_t len;
+  int fd;
+
+  len = client_make_addr(&addr, MODEM_EVENT_SOCKET);
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    client_retry(client);
+    return;
+  }
+
+  /* a local connect doesn't wait, EAGAIN is a full backlog */
+  if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+    close(fd);
+    client_retry(client);
+    return;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.u32 = CLIENT_EV_SOCKET;
+  if (epoll_ctl(client->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    close(fd);
+    client_retry(client);
+    return;
+  }
+  client->sfd = fd;
+  client->connected = true;
+  client->backoff_ms = RECONNECT_MIN_MS;
+
+  if (client->mask != MODEM_EVENT_MASK_ALL)
+    client_send_record(fd, MODEM_EVENT_SUBSCRIBE, &client->mask,
+                       sizeof(client->mask));
+  if (client->flags & MODEM_CTRL_CLIENT_STATE_PAGE)
+    client_send_record(fd, MODEM_EVENT_STATE_PAGE, NULL, 0);
+
+  if (client->on_conn)
+    client->on_conn(client->cookie, 1);
+}
+
+/*
+ * the state on connect has the seq of the last broadcast, replay the
+ * ones missed up to it, the later ones come anyway.
+ */
+static void client_resume(modem_ctrl_client *client, uint32_t seq) {
+  uint32_t range[2];
+
+  /* the first connect starts from now */
+  if (!client->synced) {
+    client->synced = true;
+    client->last_seq = seq;
+    return;
+  }
+
+  /* modemd restarted, its seq starts again */
+  if (seq < client->last_seq)
+    client->last_seq = 0;
+
+  range[0] = client->last_seq + 1;
+  range[1] = seq;
+  if (range[0] <= seq)
+    client_send_record(client->sfd, MODEM_EVENT_REPLAY, range, sizeof(range));
+  if (seq > client->last_seq)
+    client->last_seq = seq;
+}
+
+static void client_handle_record(modem_ctrl_client *client, char *record,
+                                 int n, int fd) {
+  struct modem_event_header header;
+
+  if (n < (int)sizeof(header)) {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  memcpy(&header, record, sizeof(header));
+
+  if (header.type == MODEM_EVENT_STATE_PAGE) {
+    if (fd >= 0) {
+      client_unmap_page(client);
+      client->page = client_map_page(fd);
+    } else if (strstr(record + sizeof(header), "retry")) {
+      client_send_record(client->sfd, MODEM_EVENT_STATE_PAGE, NULL, 0);
+    }
+    return;
+  }
+  if (fd >= 0)
+    close(fd);
+
+  if (header.type == MODEM_EVENT_RESPONSE) {
+    struct modem_rpc_response response;
+
+    if (header.len < sizeof(response) || NULL == client->on_response)
+      return;
+    memcpy(&response, record + sizeof(header), sizeof(response));
+    client->on_response(client->cookie, &response,
+                        record + sizeof(header) + sizeof(response));
+    return;
+  }
+
+  if (header.type == MODEM_EVENT_STATE)
+    client_resume(client, header.seq);
+  else if (header.type != MODEM_EVENT_REPLAY_GAP &&
+           header.seq > client->last_seq)
+    client->last_seq = header.seq;
+
+  if (client->on_event)
+    client->on_event(client->cookie, &header, record + sizeof(header));
+}
+
+static void client_read(modem_ctrl_client *client) {
+  char record[MODEM_EVENT_MAX_RECORD + 1];
+  int i, n, fd;
+
+  for (i = 0; i < DISPATCH_MAX_RECORD && client->sfd >= 0; i++) {
+    n = client_recv_record(client->sfd, record, sizeof(record), &fd);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      ALOGE("%s: modemd lost: %s", __FUNCTION__, n ? strerror(errno) : "eof");
+      client_disconnect(client);
+      return;
+    }
+    client_handle_record(client, record, n, fd);
+  }
+}
+
+modem_ctrl_client *modem_ctrl_client_create(uint32_t mask, unsigned int flags,
+                                            modem_ctrl_event_cb on_event,
+                                            modem_ctrl_conn_cb on_conn,
+                                            void *cookie) {
+  modem_ctrl_client *client;
+  struct epoll_event ev;
+
+  client = calloc(1, sizeof(*client));
+  if (NULL == client)
+    return NULL;
+  client->sfd = -1;
+  client->mask = mask;
+  client->flags = flags;
+  client->on_event = on_event;
+  client->on_conn = on_conn;
+  client->cookie = cookie;
+  client->backoff_ms = RECONNECT_MIN_MS;
+
+  client->epfd = epoll_create1(EPOLL_CLOEXEC);
+  client->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (client->epfd < 0 || client->tfd < 0)
+    goto fail;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = CLIENT_EV_TIMER;
+  if (epoll_ctl(client->epfd, EPOLL_CTL_ADD, client->tfd, &ev) < 0)
+    goto fail;
+
+  /* connect in the first dispatch, the callbacks only run in it */
+  client_arm_timer(client, 0);
+  return client;
+
+fail:
+  ALOGE("%s: error: %s", __FUNCTION__, strerror(errno));
+  if (client->epfd >= 0)
+    close(client->epfd);
+  if (client->tfd >= 0)
+    close(client->tfd);
+  free(client);
+  return NULL;
+}
+
+void modem_ctrl_client_destroy(modem_ctrl_client *client) {
+  if (NULL == client)
+    return;
+
+  if (client->sfd >= 0)
+    close(client->sfd);
+  client_unmap_page(client);
+  close(client->tfd);
+  close(client->epfd);
+  free(client);
+}
+
+int modem_ctrl_client_fd(const modem_ctrl_client *client) {
+  return client->epfd;
+}
+
+int modem_ctrl_client_dispatch(modem_ctrl_client *client) {
+  struct epoll_event events[2];
+  uint64_t expired;
+  int i, n;
+
+  n = epoll_wait(client->epfd, events, 2, 0);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  for (i = 0; i < n; i++) {
+    if (events[i].data.u32 == CLIENT_EV_TIMER) {
+      if (read(client->tfd, &expired, sizeof(expired)) > 0 &&
+          client->sfd < 0)
+        client_connect(client);
+    } else if (events[i].events & EPOLLIN) {
+      /* the pending records first, the hangup is seen after them */
+      client_read(client);
+    } else if (client->sfd >= 0) {
+      client_disconnect(client);
+    }
+  }
+  return 0;
+}
+
+int modem_ctrl_client_command(modem_ctrl_client *client, const char *command) {
+  if (client->sfd < 0)
+    return -1;
+
+  return client_send_record(client->sfd, MODEM_EVENT_COMMAND, command,
+                            strlen(command) + 1);
+}
+
+void modem_ctrl_client_set_response_cb(modem_ctrl_client *client,
+                                       modem_ctrl_response_cb on_response) {
+  client->on_response = on_response;
+}
+
+int modem_ctrl_client_request(modem_ctrl_client *client, uint32_t op,
+                              uint32_t arg) {
+  struct modem_rpc_request request;
+
+  if (client->sfd < 0)
+    return -1;
+
+  /* ids stay positive */
+  if (++client->request_id > INT32_MAX)
+    client->request_id = 1;
+  request.id = client->request_id;
+  request.op = op;
+  request.arg = arg;
+  if (client_send_record(client->sfd, MODEM_EVENT_REQUEST, &request,
+                         sizeof(request)) < 0)
+    return -1;
+  return request.id;
+}
+
+int modem_ctrl_client_read_state(modem_ctrl_client *client,
+                                 struct modem_state_page *copy) {
+  if (NULL == client->page)
+    return -1;
+
+  return modem_state_page_read(client->page, copy);
+}
+
+const struct modem_state_page *modem_ctrl_state_page_map(int timeout_ms) {
+  char record[MODEM_EVENT_MAX_RECORD + 1];
+  struct modem_state_page *page = NULL;
+  struct modem_event_header header;
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+  socklen_t len;
+  int sfd, fd, i, n;
+
+  len = client_make_addr(&addr, MODEM_EVENT_SOCKET);
+  sfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sfd < 0)
+    return NULL;
+  if (connect(sfd, (struct sockaddr *)&addr, len) < 0 ||
+      client_send_record(sfd, MODEM_EVENT_STATE_PAGE, NULL, 0) < 0) {
+    close(sfd);
+    return NULL;
+  }
+
+  /* the state on connect and broadcasts may come first */
+  for (i = 0; i < STATE_PAGE_MAX_RECORD && NULL == page; i++) {
+    pfd.fd = sfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+      break;
+
+    n = client_recv_record(sfd, record, sizeof(record), &fd);
+    if (n < (int)sizeof(header))
+      break;
+    memcpy(&header, record, sizeof(header));
+    if (header.type != MODEM_EVENT_STATE_PAGE) {
+      if (fd >= 0)
+        close(fd);
+      continue;
+    }
+    if (fd < 0)
+      break;
+    page = client_map_page(fd);
+    break;
+  }
+
+  close(sfd);
+  return page;
+}
+
+void modem_ctrl_state_page_unmap(const struct modem_state_page *page) {
+  if (page)
+    munmap((void *)page, MODEM_STATE_PAGE_SIZE);
+}
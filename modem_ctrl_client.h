@@ -0,0 +1,89 @@
+/**
+ * modem_ctrl_client.h --- libmodemctrl, the client side of modemd.
+ *
+ * A client connects to modemd_v2 without blocking, subscribes to the
+ * given event classes and calls back from the caller's own event loop:
+ * poll modem_ctrl_client_fd() for POLLIN and call
+ * modem_ctrl_client_dispatch() when it's readable, the fd stays the
+ * same across reconnects.
+ *
+ * When modemd goes away the client reconnects with a backoff and
+ * replays the broadcasts it missed, a MODEM_EVENT_REPLAY_GAP event
+ * tells that some of them are lost. A replayed event may come after a
+ * newer one, the seq of the header gives the order.
+ *
+ * With MODEM_CTRL_CLIENT_STATE_PAGE the client maps the state page on
+ * every connect, modem_ctrl_client_read_state() reads it without a
+ * syscall.
+ *
+ * The calls on one client must not run concurrently.
+ *
+ * Copyright (C) 2019 Spreadtrum Communications Inc.
+ */
+#ifndef MODEM_CTRL_CLIENT_H_
+#define MODEM_CTRL_CLIENT_H_
+
+#include <stdint.h>
+
+#include "modem_event_proto.h"
+#include "modem_state_page.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* map the state page on connect */
+#define MODEM_CTRL_CLIENT_STATE_PAGE 0x1
+
+typedef struct modem_ctrl_client modem_ctrl_client;
+
+/*
+ * a broadcast or a reply, text is the NUL terminated payload,
+ * both are only valid during the call.
+ */
+typedef void (*modem_ctrl_event_cb)(void *cookie,
+                                    const struct modem_event_header *header,
+                                    const char *text);
+/* connected is 1 after a connect, 0 when the connection is lost */
+typedef void (*modem_ctrl_conn_cb)(void *cookie, int connected);
+/* the response to modem_ctrl_client_request(), text is the result */
+typedef void (*modem_ctrl_response_cb)(void *cookie,
+                                       const struct modem_rpc_response *response,
+                                       const char *text);
+
+/* mask is MODEM_EVENT_MASK_ALL or the MODEM_SUBSCRIBE_* classes */
+modem_ctrl_client *modem_ctrl_client_create(uint32_t mask, unsigned int flags,
+                                            modem_ctrl_event_cb on_event,
+                                            modem_ctrl_conn_cb on_conn,
+                                            void *cookie);
+void modem_ctrl_client_destroy(modem_ctrl_client *client);
+
+/* the fd to poll for POLLIN */
+int modem_ctrl_client_fd(const modem_ctrl_client *client);
+/* handle what's ready without blocking, the callbacks run in it */
+int modem_ctrl_client_dispatch(modem_ctrl_client *client);
+
+/* a legacy command such as "Modem Blocked", -1 if not connected */
+int modem_ctrl_client_command(modem_ctrl_client *client, const char *command);
+
+void modem_ctrl_client_set_response_cb(modem_ctrl_client *client,
+                                       modem_ctrl_response_cb on_response);
+/*
+ * send a MODEM_RPC_* request, return its id or -1 if not connected,
+ * a request in flight when the connection is lost gets no response.
+ */
+int modem_ctrl_client_request(modem_ctrl_client *client, uint32_t op,
+                              uint32_t arg);
+/* 0, or -1 if the page isn't mapped or modemd kept writing it */
+int modem_ctrl_client_read_state(modem_ctrl_client *client,
+                                 struct modem_state_page *copy);
+
+/* map the state page with a blocking request, NULL if it can't be got */
+const struct modem_state_page *modem_ctrl_state_page_map(int timeout_ms);
+void modem_ctrl_state_page_unmap(const struct modem_state_page *page);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
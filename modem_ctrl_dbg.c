@@ -9,9 +9,13 @@
  *  Initial version.
  *
  */
+#include <time.h>
+
 #include "modem_control.h"
 #include "modem_io_control.h"
 #include "modem_load.h"
+#include "modem_pcie_bar.h"
+#include "modem_ctrl_client.h"
 
 static modem_load_info g_cp_load_info;
 static modem_load_info g_sp_load_info;
@@ -24,6 +28,7 @@ static modem_load_info g_dp_load_info;
 #define DP_DEV_PATH "/dev/dpsys"
 
 #define MAX_ONECE_READ_SIZE 32*1024*1024
+#define STATE_PAGE_TIMEOUT_MS 1000
 #define INVALID_INDEX 0xFFFF
 
 #define    ERROR_OPEN_DIR 1
@@ -47,17 +52,26 @@ enum {
   ACTION_HELP = 0,
   ACTION_GET_INFO,
   ACTION_DUMP_MEMORY,
+  ACTION_BENCH,
   ACTION_CNT
 };
 
 #define DUMP_CMD "dump"
 #define GET_CMD "get"
+#define BENCH_CMD "bench"
 #define MODEM_STORE_PATH "/data/modem_dump/"
 
+#define BENCH_DEFAULT_PATH MODEM_STORE_PATH "bar_bench.bin"
+#define BENCH_DEFAULT_SIZE (16 * 1024 * 1024)
+#define BENCH_LOOP 5
+#define BENCH_BUF_SIZE (512 * 1024)
+
 typedef struct modem_cmd_tag {
     uint32_t action;
     uint32_t system;
     uint32_t index;
+    char *bench_path;
+    uint32_t bench_size;
 }modem_cmd;
 
 static int usage(void) {
@@ -80,9 +94,15 @@ static int usage(void) {
             "[dump] [dp] [index]\n"
             #endif
             "\n"
+            "benchmark write() path against bar mmap path,\n"
+            "a plain file stands in for the ep memory\n"
+            "==== Usage: ====\n"
+            "[bench] [file] [size in KB]\n"
+            "\n"
             "==== eg: ====\n"
             "get cp\n"
-            "dump cp 0\n");
+            "dump cp 0\n"
+            "bench " BENCH_DEFAULT_PATH " 16384\n");
 
     return 0;
 }
@@ -110,6 +130,69 @@ static int init_load_info(void)
     return ret;
 }
 
+static int modem_dbg_read_page(struct modem_state_page *copy) {
+    const struct modem_state_page *page;
+    int ret;
+
+    page = modem_ctrl_state_page_map(STATE_PAGE_TIMEOUT_MS);
+    if (!page)
+        return -1;
+    ret = modem_state_page_read(page, copy);
+    modem_ctrl_state_page_unmap(page);
+
+    return ret;
+}
+
+static void modem_dbg_page_to_info(const struct modem_state_load_info *src,
+                                   modem_load_info *info) {
+    uint32_t i;
+
+    memset(info, 0, sizeof(*info));
+    info->region_cnt = min(src->region_cnt, MAX_REGION_CNT);
+    info->modem_base = src->modem_base;
+    info->modem_size = src->modem_size;
+    info->all_base = src->all_base;
+    info->all_size = src->all_size;
+    for (i = 0; i < info->region_cnt; i++) {
+        info->regions[i].address = src->regions[i].address;
+        info->regions[i].size = src->regions[i].size;
+        strncpy(info->regions[i].name, src->regions[i].name,
+                MAX_REGION_NAME_LEN);
+    }
+}
+
+/*
+ * get the load info from the state page of modemd instead of the
+ * ioctls, -1 if there is no page or modemd didn't set the system.
+ */
+static int modem_dbg_page_load_info(uint32_t system) {
+    struct modem_state_page page;
+
+    if (modem_dbg_read_page(&page)
+        || page.load_info[system].region_cnt == 0)
+        return -1;
+
+    modem_dbg_page_to_info(&page.load_info[MODEM_STATE_SYS_CP],
+                           &g_cp_load_info);
+    modem_dbg_page_to_info(&page.load_info[MODEM_STATE_SYS_SP],
+                           &g_sp_load_info);
+#ifdef FEATURE_EXTERNAL_MODEM
+    modem_dbg_page_to_info(&page.load_info[MODEM_STATE_SYS_DP],
+                           &g_dp_load_info);
+#endif
+
+    fprintf(stdout,
+            "modem state = %d, resets = %u, asserts = %u, "
+            "last load: type = 0x%x, ret = %d, %uKB in %ums.\n",
+            page.state, page.reset_count, page.assert_count,
+            page.load_type, page.load_ret, page.load_done_kb,
+            page.load_time_ms);
+    if (page.last_assert[0])
+        fprintf(stdout, "last assert: %s\n", page.last_assert);
+
+    return 0;
+}
+
 static int modem_dbg_print_info(modem_load_info *load_info, int system) {
     char *sys;
     uint32_t i;
@@ -307,17 +390,158 @@ static int modem_dbg_proc_dump(modem_cmd *cmd) {
     return ERROR_UNDEFINE_SYSTEM;
 }
 
+static uint64_t modem_dbg_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the same read/write loop as modem_load_image */
+static int modem_dbg_bench_write(int fdin, int fdout, char *buf,
+                                 uint32_t size) {
+    int rrsize, wsize;
+
+    do {
+        rrsize = read(fdin, buf, min(size, BENCH_BUF_SIZE));
+        if (rrsize <= 0)
+            return -1;
+
+        wsize = write(fdout, buf, rrsize);
+        if (wsize != rrsize)
+            return -1;
+
+        size -= rrsize;
+    } while (size > 0);
+
+    return 0;
+}
+
+static int modem_dbg_bench_verify(char *path, char *src, uint32_t size) {
+    char *buf;
+    int fd, ret = -1;
+
+    buf = malloc(size);
+    fd = open(path, O_RDONLY);
+    if (buf && fd >= 0 && read(fd, buf, size) == (ssize_t)size)
+        ret = memcmp(buf, src, size) ? -1 : 0;
+
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return ret;
+}
+
+static int modem_dbg_bench(modem_cmd *cmd) {
+    char src_path[MAX_PATH_LEN + 1];
+    char *path = cmd->bench_path;
+    uint32_t i, size = cmd->bench_size;
+    uint64_t t, best_write = UINT64_MAX, best_bar = UINT64_MAX;
+    char *src, *buf;
+    int fdin, fdout, ret = 0;
+    MODEM_BAR_S bar;
+
+    snprintf(src_path, sizeof(src_path), "%s.src", path);
+    fprintf(stdout, "bench: %s, size = 0x%x\n", path, size);
+
+    src = malloc(size);
+    buf = malloc(BENCH_BUF_SIZE);
+    if (!src || !buf) {
+        free(src);
+        free(buf);
+        return ERROR_WRITE_FILE;
+    }
+
+    for (i = 0; i < size; i++)
+        src[i] = (char)(i * 131 + (i >> 12));
+
+    /* the source image and the stand-in of ep memory */
+    fdout = open(src_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fdout < 0 || write(fdout, src, size) != (ssize_t)size)
+        ret = ERROR_WRITE_FILE;
+    if (fdout >= 0)
+        close(fdout);
+
+    fdout = open(path, O_RDWR | O_CREAT, 0600);
+    if (ret || fdout < 0 || ftruncate(fdout, size)) {
+        fprintf(stdout, "prepare %s fail!\n", path);
+        ret = ERROR_OPEN_WRITE_FILE;
+        goto leave;
+    }
+
+    for (i = 0; i < BENCH_LOOP && !ret; i++) {
+        fdin = open(src_path, O_RDONLY);
+        if (fdin < 0) {
+            ret = ERROR_OPEN_READ_FILE;
+            break;
+        }
+
+        /* write() path */
+        lseek(fdout, 0, SEEK_SET);
+        t = modem_dbg_now_us();
+        if (modem_dbg_bench_write(fdin, fdout, buf, size))
+            ret = ERROR_WRITE_FILE;
+        best_write = min(best_write, modem_dbg_now_us() - t);
+
+        /* bar path, mmap + non-temporal copy */
+        lseek(fdin, 0, SEEK_SET);
+        t = modem_dbg_now_us();
+        if (modem_bar_open(&bar, path, 0, size)) {
+            ret = ERROR_OPEN_WRITE_FILE;
+        } else {
+            if (modem_bar_load_fd(&bar, fdin, 0, size))
+                ret = ERROR_WRITE_FILE;
+            modem_bar_close(&bar);
+        }
+        best_bar = min(best_bar, modem_dbg_now_us() - t);
+
+        close(fdin);
+    }
+
+    if (!ret && modem_dbg_bench_verify(path, src, size)) {
+        fprintf(stdout, "verify %s fail!\n", path);
+        ret = ERROR_READ_FILE;
+    }
+
+    if (!ret) {
+        fprintf(stdout, "write(): %llu us, %llu KB/s\n",
+                (unsigned long long)best_write,
+                (unsigned long long)size * 1000 / 1024 * 1000
+                    / max(best_write, 1));
+        fprintf(stdout, "bar:     %llu us, %llu KB/s\n",
+                (unsigned long long)best_bar,
+                (unsigned long long)size * 1000 / 1024 * 1000
+                    / max(best_bar, 1));
+    }
+
+leave:
+    if (fdout >= 0)
+        close(fdout);
+    unlink(src_path);
+    free(src);
+    free(buf);
+    return ret;
+}
+
 static int modem_dbg_proc(modem_cmd *cmd) {
     int ret;
 
     if (cmd->action == ACTION_HELP)
         return usage();
 
+    if (cmd->action == ACTION_BENCH)
+        return modem_dbg_bench(cmd);
+
     if (cmd->system >= MODEM_CNT
         || (cmd->action == ACTION_DUMP_MEMORY
             && cmd->index == INVALID_INDEX))
         return ERROR_INVALID_INDEX;
 
+    /* modemd publishes what get needs, no ioctl */
+    if (cmd->action == ACTION_GET_INFO
+        && 0 == modem_dbg_page_load_info(cmd->system))
+        return modem_dbg_proc_get(cmd);
+
     ret = init_load_info();
     if (ret)
         return ERROR_GET_LOAD_INFO;
@@ -339,12 +563,25 @@ int main(int argc, char **argv) {
     cmd.action = ACTION_HELP;
     cmd.system = MODEM_CNT;
     cmd.index  = INVALID_INDEX;
+    cmd.bench_path = BENCH_DEFAULT_PATH;
+    cmd.bench_size = BENCH_DEFAULT_SIZE;
 
     if (argc > 1) {
         if (0 == strcmp(argv[1], DUMP_CMD))
             cmd.action = ACTION_DUMP_MEMORY;
         else if (0 == strcmp(argv[1], GET_CMD))
             cmd.action = ACTION_GET_INFO;
+        else if (0 == strcmp(argv[1], BENCH_CMD))
+            cmd.action = ACTION_BENCH;
+    }
+
+    if (cmd.action == ACTION_BENCH) {
+        if (argc > 2)
+            cmd.bench_path = argv[2];
+        if (argc > 3 && atoi(argv[3]) > 0)
+            cmd.bench_size = atoi(argv[3]) * 1024;
+
+        return modem_dbg_proc(&cmd);
     }
 
     if (argc > 2) {
@@ -73,7 +73,8 @@ void modem_event_triger(BaseUEventInfo *info, void *data)
   case MDM_WARM_RESET:
     MODEM_LOGD("recv WARM RESET.");
 #ifdef FEATURE_EXTERNAL_MODEM
-    load_spl_img();
+    /* don't hold the uevent worker while loading */
+    load_spl_img_async(NULL, NULL, NULL);
 #endif
     break;
 
@@ -0,0 +1,136 @@
+/**
+ * modem_event_proto.h --- framed modem event protocol.
+ *
+ * modemd_v2 is a SOCK_SEQPACKET socket next to the legacy modemd one,
+ * every packet is one record: a modem_event_header followed by len bytes
+ * of payload, so events never merge and the type is known without
+ * parsing the text. The payload is the legacy text message with its
+ * terminating NUL.
+ *
+ * Clients send MODEM_EVENT_COMMAND records, the payload is a legacy
+ * command such as "Modem Blocked" or "SLOGMODEM DUMP COMPLETE".
+ *
+ * A client gets every broadcast until it sends a MODEM_EVENT_SUBSCRIBE
+ * record, the payload is a uint32_t mask of MODEM_EVENT_MASK(type).
+ * Legacy clients can send "Modem Subscribe: alive,assert,..." with the
+ * class names below. Replies to a client are not filtered.
+ *
+ * modemd keeps the recent broadcasts, a client which reconnects sends a
+ * MODEM_EVENT_REPLAY record with the uint32_t seq to replay from and an
+ * optional uint32_t seq to replay up to, 0 for the last one. It gets
+ * the kept records in the range as they were sent, after a
+ * MODEM_EVENT_REPLAY_GAP record if some of them are no longer kept.
+ * Legacy clients send "Modem Replay: <from> [to]" and get the texts.
+ * Load progress is outdated soon, it has seq 0 and isn't kept.
+ * The MODEM_EVENT_STATE record sent on connect has the seq of the last
+ * broadcast, the later ones have a larger seq and come anyway, so a
+ * client which reconnects replays up to it to get every event once.
+ *
+ * A MODEM_EVENT_STATE_PAGE record (legacy "Modem State Page") asks for
+ * the fd of the state page in modem_state_page.h, the reply of the same
+ * type carries it as SCM_RIGHTS. It has no fd and the text is "Modem
+ * State Page: retry" if the messages queued to the client aren't sent
+ * yet, or "Modem State Page: none" if modemd has no page.
+ *
+ * A MODEM_EVENT_REQUEST record (payload struct modem_rpc_request) asks
+ * modemd for something, it gets one MODEM_EVENT_RESPONSE with the same
+ * id: a struct modem_rpc_response followed by the NUL terminated text
+ * of the result. Queries are answered at once, reset, assert and dump
+ * when modem control has run them. Legacy clients send
+ * "Modem Request: <id> <op> [arg]" with op state, load, reset, assert,
+ * dump or metrics, and get
+ * "Modem Response: id=<id> op=<op> status=<status> latency=<us>us; <text>".
+ * status is 0 or a negative errno:
+ *   -EINVAL  unknown op or arg
+ *   -EPERM   the reset or dump property is off
+ *   -EAGAIN  the modem isn't alive to assert
+ *   -EBUSY   too many requests are running
+ *
+ * Copyright (C) 2019 Spreadtrum Communications Inc.
+ */
+#ifndef MODEM_EVENT_PROTO_H_
+#define MODEM_EVENT_PROTO_H_
+
+#include <stdint.h>
+
+#define MODEM_EVENT_SOCKET "modemd_v2"
+#define MODEM_EVENT_VERSION 1
+/* a larger record is truncated by the socket */
+#define MODEM_EVENT_MAX_RECORD 4096
+#define MODEM_EVENT_MAX_PAYLOAD \
+  (MODEM_EVENT_MAX_RECORD - sizeof(struct modem_event_header))
+
+enum modem_event_type {
+  MODEM_EVENT_COMMAND = 0,    /* client to modemd */
+  MODEM_EVENT_STATE,          /* current state, sent on connect */
+  MODEM_EVENT_ALIVE,
+  MODEM_EVENT_ASSERT,
+  MODEM_EVENT_RESET,
+  MODEM_EVENT_BLOCKED,
+  MODEM_EVENT_AGDSP_ASSERT,
+  MODEM_EVENT_LOAD_PROGRESS,
+  MODEM_EVENT_LOAD_DONE,
+  MODEM_EVENT_CLIENT_STATS,
+  MODEM_EVENT_OTHER,          /* any other text message */
+  MODEM_EVENT_DUMP,           /* dump progress relayed to clients */
+  MODEM_EVENT_SUBSCRIBE,      /* client to modemd */
+  MODEM_EVENT_REPLAY,         /* client to modemd */
+  MODEM_EVENT_REPLAY_GAP,     /* seq is the first kept, payload is text */
+  MODEM_EVENT_STATE_PAGE,     /* both ways, the reply carries the fd */
+  MODEM_EVENT_REQUEST,        /* client to modemd */
+  MODEM_EVENT_RESPONSE,       /* reply to a request */
+  MODEM_EVENT_TYPE_MAX
+};
+
+#define MODEM_EVENT_MASK(type) (1u << (type))
+#define MODEM_EVENT_MASK_ALL 0xffffffffu
+
+/*
+ * the message classes, the legacy names are
+ * alive, assert, reset, block, agdsp, dump, load, other and all.
+ */
+#define MODEM_SUBSCRIBE_ALIVE MODEM_EVENT_MASK(MODEM_EVENT_ALIVE)
+#define MODEM_SUBSCRIBE_ASSERT MODEM_EVENT_MASK(MODEM_EVENT_ASSERT)
+#define MODEM_SUBSCRIBE_RESET MODEM_EVENT_MASK(MODEM_EVENT_RESET)
+#define MODEM_SUBSCRIBE_BLOCK MODEM_EVENT_MASK(MODEM_EVENT_BLOCKED)
+#define MODEM_SUBSCRIBE_AGDSP MODEM_EVENT_MASK(MODEM_EVENT_AGDSP_ASSERT)
+#define MODEM_SUBSCRIBE_DUMP MODEM_EVENT_MASK(MODEM_EVENT_DUMP)
+#define MODEM_SUBSCRIBE_LOAD \
+  (MODEM_EVENT_MASK(MODEM_EVENT_LOAD_PROGRESS) | \
+   MODEM_EVENT_MASK(MODEM_EVENT_LOAD_DONE))
+#define MODEM_SUBSCRIBE_OTHER \
+  (MODEM_EVENT_MASK(MODEM_EVENT_STATE) | MODEM_EVENT_MASK(MODEM_EVENT_OTHER))
+
+enum modem_rpc_op {
+  MODEM_RPC_GET_STATE = 1,    /* the state, counters and last assert */
+  MODEM_RPC_GET_LOAD,         /* arg MODEM_STATE_SYS_*, regions and timing */
+  MODEM_RPC_RESET,            /* reload the modem */
+  MODEM_RPC_ASSERT,           /* assert the alive modem */
+  MODEM_RPC_DUMP,             /* assert the modem to save a dump */
+  MODEM_RPC_METRICS,          /* request, uevent and client stats */
+  MODEM_RPC_OP_MAX
+};
+
+struct modem_rpc_request {
+  uint32_t id;         /* chosen by the client, echoed in the response */
+  uint32_t op;         /* enum modem_rpc_op */
+  uint32_t arg;
+};
+
+struct modem_rpc_response {
+  uint32_t id;
+  uint32_t op;
+  int32_t status;      /* 0 or a negative errno */
+  uint32_t latency_us; /* from the request to the response */
+};
+
+struct modem_event_header {
+  uint16_t version;    /* MODEM_EVENT_VERSION */
+  uint16_t type;       /* enum modem_event_type */
+  uint32_t len;        /* payload bytes after the header */
+  uint32_t seq;        /* broadcast sequence, 0 for load progress and replies */
+  uint32_t reserved;
+  uint64_t timestamp;  /* CLOCK_BOOTTIME in ns */
+};
+
+#endif
@@ -6,6 +6,7 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <cutils/properties.h>
 
 #include "modem_load.h"
@@ -14,11 +15,17 @@
 #include "xml_parse.h"
 #include "modem_head_parse.h"
 #include "modem_io_control.h"
+#include "modem_connect.h"
+#include "modem_state.h"
 
-#ifdef FEATURE_PCIE_RESCAN
+#if defined(FEATURE_PCIE_RESCAN) || defined(FEATURE_PCIE_BAR_LOAD)
 #include "modem_pcie_control.h"
 #endif
 
+#ifdef FEATURE_PCIE_BAR_LOAD
+#include "modem_pcie_bar.h"
+#endif
+
 #if defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) || defined(CONFIG_VBOOT_V2)
 #include "secure_boot_load.h"
 #endif
@@ -28,6 +35,28 @@
 #define PMCP_CALI_PATH "/vendor/firmware/EXEC_CALIBRATE_MAG_IMAGE"
 #define EXTERN_MDMCTRL_PATH "/dev/mdm_ctrl"
 
+#ifdef FEATURE_PCIE_BAR_LOAD
+/* 1: load modem images by the mapped ep bar, 0: write() to ioctl node */
+#define MODEM_BAR_LOAD_PROP "persist.vendor.modem.bar_load"
+#define MODEM_BAR_INDEX_PROP "ro.vendor.modem.ep.bar"
+#endif
+
+/* 1: load sp, cp and dp images concurrently, 0: load them one by one */
+#define MODEM_PARALLEL_LOAD_PROP "persist.vendor.modem.parallel_load"
+/* reuse the verified fixnv on reload if it's unchanged on flash */
+#define MODEM_NV_SHADOW_PROP "persist.vendor.modem.nv_shadow"
+/* modem_load_image uses a 512K stack buffer */
+#define LOAD_JOB_STACK_SIZE (2 * 1024 * 1024)
+/* max bytes copied between two cancel checks */
+#define LOAD_CHUNK_MAX_SIZE (4 * 1024 * 1024)
+/* transient io error retry, delay doubles every retry */
+#define LOAD_RETRY_MAX 5
+#define LOAD_RETRY_DELAY_US (10 * 1000)
+/* max passes to resume the unfinished regions */
+#define LOAD_RESUME_MAX_PASS 2
+/* min interval of the progress report in the same region */
+#define LOAD_PROGRESS_INTERVAL_MS 200
+
 #define FIXNV_BANK  "fixnv"
 #define RUNNV_BANK_RD "runtimenv"
 #define RUNNV_BANK_WT "runnv"
@@ -55,6 +84,117 @@ static LOAD_VALUE_S dp_load_info;
 static LOAD_NODE_INFO *modem_node_info = NULL;
 static uint modem_node_num = 0;
 
+#ifdef FEATURE_PCIE_BAR_LOAD
+static MODEM_BAR_S ep_bar = {.fd = -1};
+static int ep_bar_enable = 0;
+#endif
+
+/*
+ * every load request gets a new generation, an in-flight load
+ * whose generation is no longer the newest one is cancelled.
+ * loads are serialized by load_mutex.
+ */
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint32_t load_gen = 0;
+static uint32_t load_cur_gen = 0;
+
+void modem_load_cancel(const char *reason) {
+  uint32_t gen = __sync_add_and_fetch(&load_gen, 1);
+
+  MODEM_LOGD("%s: %s, gen = %u\n", __FUNCTION__, reason, gen);
+}
+
+static int modem_load_cancelled(void) {
+  return load_cur_gen != __sync_fetch_and_add(&load_gen, 0);
+}
+
+/* preempt the in-flight load, return after it has stopped */
+static void modem_load_begin(void) {
+  uint32_t gen = __sync_add_and_fetch(&load_gen, 1);
+
+  pthread_mutex_lock(&load_mutex);
+  load_cur_gen = gen;
+}
+
+static void modem_load_end(void) {
+  pthread_mutex_unlock(&load_mutex);
+}
+
+/*
+ * load progress, shared by the concurrent load jobs,
+ * reported to clients when the region changes or every 200ms.
+ */
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int progress_type;
+static uint64_t progress_done;
+static uint64_t progress_start_ms;
+static uint64_t progress_report_ms;
+static char progress_region[MAX_FILE_NAME_LEN + 1];
+
+static uint64_t modem_load_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void modem_load_progress_begin(int load_type) {
+  pthread_mutex_lock(&progress_mutex);
+  progress_type = load_type;
+  progress_done = 0;
+  progress_start_ms = modem_load_now_ms();
+  progress_report_ms = 0;
+  progress_region[0] = 0;
+  pthread_mutex_unlock(&progress_mutex);
+}
+
+static void modem_load_progress_update(const char *region, uint size) {
+  char buf[128];
+  uint64_t now, speed;
+  int len = 0;
+
+  now = modem_load_now_ms();
+
+  pthread_mutex_lock(&progress_mutex);
+  progress_done += size;
+  if (strcmp(progress_region, region)
+      || now - progress_report_ms >= LOAD_PROGRESS_INTERVAL_MS) {
+    strncpy(progress_region, region, MAX_FILE_NAME_LEN);
+    progress_report_ms = now;
+
+    /* KB/s = bytes/ms */
+    speed = progress_done / max(now - progress_start_ms, 1);
+    len = snprintf(buf, sizeof(buf),
+                   "%s: type=0x%x region=%s done=%luKB speed=%luKB/s",
+                   MODEM_LOAD_PROGRESS, progress_type, progress_region,
+                   (unsigned long)(progress_done >> 10),
+                   (unsigned long)speed);
+  }
+  pthread_mutex_unlock(&progress_mutex);
+
+  if (len > 0)
+    modem_notify_clients(buf, strlen(buf) + 1);
+}
+
+static void modem_load_progress_end(int ret) {
+  char buf[128];
+  uint64_t done, cost;
+
+  pthread_mutex_lock(&progress_mutex);
+  done = progress_done;
+  cost = modem_load_now_ms() - progress_start_ms;
+  pthread_mutex_unlock(&progress_mutex);
+
+  MODEM_LOGD("%s: type=0x%x ret=%d done=0x%lx cost=%lums\n", __FUNCTION__,
+             progress_type, ret, (unsigned long)done, (unsigned long)cost);
+  modem_state_set_load(progress_type, ret, done >> 10, cost);
+
+  snprintf(buf, sizeof(buf), "%s: type=0x%x ret=%d done=%luKB time=%lums",
+           MODEM_LOAD_DONE, progress_type, ret,
+           (unsigned long)(done >> 10), (unsigned long)cost);
+  modem_notify_clients(buf, strlen(buf) + 1);
+}
+
 static int write_proc_file(char *file, int offset, char *string) {
   int fd, stringsize, res = -1, retry = 0;
 
@@ -294,77 +434,144 @@ static int modem_load_cp_boot_code(char *fout)
 }
 
 
-static void modem_load_cp_nv(char* read, char* write) {
+/* start checking the nv copies in background */
+static nv_partition_t *modem_validate_cp_nv(IMAGE_LOAD_S *img) {
   char path[MAX_PATH_LEN + 1];
   char bak[MAX_PATH_LEN + 1];
+  char prop[PROPERTY_VALUE_MAX] = {0};
+
+  mstrncpy2(path, img->path_r, "1"); // xxnv1
+  mstrncpy2(bak, img->path_r, "2");  //xxnv2
+
+  /* runtimenv is changed by modem at runtime, always read it */
+  property_get(MODEM_NV_SHADOW_PROP, prop, "1");
+  if (atoi(prop) && strstr(img->path_r, FIXNV_BANK))
+    return nv_partition_validate_shadow(path, bak);
 
-  mstrncpy2(path, read, "1"); // xxnv1
-  mstrncpy2(bak, read, "2");  //xxnv2
-  MODEM_LOGD("%s: path=%s, bak_path=%s, out=%s\n",
-             __func__, path, bak, write);
-  read_nv_partition(path, bak, write);
+  return nv_partition_validate(path, bak);
 }
 
+static void modem_load_cp_nv(IMAGE_LOAD_S *img) {
+  nv_partition_t *nv = img->nv;
+
+  img->nv = NULL;
+  if (!nv)
+    nv = modem_validate_cp_nv(img);
+
+  MODEM_LOGD("%s: %s, out=%s\n", __func__, img->path_r, img->path_w);
+  nv_partition_commit(nv, img->path_w);
+}
+
+/* drop the nv checks which are not committed */
+static void modem_release_cp_nv(LOAD_VALUE_S *load) {
+  IMAGE_LOAD_S *table = load->load_table;
+  uint i;
+
+  for (i = 0; i < load->table_num; i++, table++) {
+    if (table->nv) {
+      nv_partition_release(table->nv);
+      table->nv = NULL;
+    }
+  }
+}
+
+static int load_img_region(LOAD_VALUE_S *load, uint i) {
+  IMAGE_LOAD_S *tmp_table = load->load_table + i;
+  unsigned int load_offset = 0;
+  size_t load_size = 0;
+
+  if (load->ioctrl_is_ok)
+     modem_set_write_region(load->io_ctrl, i);
+
+  if (GET_FLAG(tmp_table->flag, CMDLINE_FLAG)) {
+     MODEM_LOGD("%s: load cpcmdline\n", __func__);
+     modem_load_cp_cmdline("/proc/cmdline", tmp_table->path_w);
+     return 0;
+  }
+
+  if (GET_FLAG(tmp_table->flag, NV_FLAG)) {
+    MODEM_LOGD("%s: load nv\n", __func__);
+    modem_load_cp_nv(tmp_table);
+    return 0;
+  }
+
+  if (GET_FLAG(tmp_table->flag, BOOT_CODE)) {
+     MODEM_LOGD("%s: load boot code\n", __func__);
+     modem_load_cp_boot_code(tmp_table->path_w);
+     return 0;
+  }
+
+#if (defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) \
+            || defined(CONFIG_VBOOT_V2))
+  if (GET_FLAG(tmp_table->flag, SECURE_FLAG))
+    return secure_boot_load_img(tmp_table);
+#endif
+  modem_get_patiton_info(tmp_table, &load_offset, &load_size);
+  return modem_load_image(tmp_table, load_offset, 0, load_size);
+}
+
+/*
+ * a failed region keeps its checkpoint(img->done), after a pass,
+ * only the unfinished regions are loaded again from the checkpoint.
+ */
 static int load_img_from_table(LOAD_VALUE_S *load,
                                uint32_t load_flag,
                                uint32_t skip_flag) {
   IMAGE_LOAD_S *tmp_table;
-  uint i, max;
-  unsigned int load_offset = 0;
-  size_t load_size = 0;
-  char *ioctrl;
+  uint i, max, pass;
   int ret = 0;
 
   tmp_table = load->load_table;
   max = load->table_num;
-  ioctrl = load->io_ctrl;
   MODEM_LOGIF("load img: load_flag = 0x%x, skip_flag = 0x%x!\n",
               load_flag, skip_flag);
 
   for (i = 0; i < max; i++, tmp_table++) {
-    /* skip invalid tabel */
-    if (tmp_table->size == 0)
-      continue;
-
-    /* first,  skip */
-    if (tmp_table->flag & skip_flag)
-      continue;
+    /* skip invalid tabel, than skip, than load */
+    tmp_table->pending = tmp_table->size != 0
+                         && !(tmp_table->flag & skip_flag)
+                         && (tmp_table->flag & load_flag);
+    tmp_table->done = 0;
+
+    /*
+     * fixnv and runnv are checked concurrently ahead, but written
+     * one by one in table order, the write region is global.
+     */
+    tmp_table->nv = NULL;
+    if (tmp_table->pending && GET_FLAG(tmp_table->flag, NV_FLAG))
+      tmp_table->nv = modem_validate_cp_nv(tmp_table);
+  }
 
-    /* than,  load */
-    if ((tmp_table->flag & load_flag)) {
-      if (load->ioctrl_is_ok)
-         modem_set_write_region(ioctrl, i);
+  for (pass = 0; pass <= LOAD_RESUME_MAX_PASS; pass++) {
+    if (pass > 0) {
+      MODEM_LOGE("%s: %s resume unfinished regions, pass %d\n",
+                 __func__, load->name, pass);
+      usleep(LOAD_RETRY_DELAY_US << pass);
+    }
 
-      if (GET_FLAG(tmp_table->flag, CMDLINE_FLAG)) {
-         MODEM_LOGD("%s: load cpcmdline\n", __func__);
-         modem_load_cp_cmdline("/proc/cmdline", tmp_table->path_w);
-         continue;
+    ret = 0;
+    tmp_table = load->load_table;
+    for (i = 0; i < max; i++, tmp_table++) {
+      if (modem_load_cancelled()) {
+        MODEM_LOGE("%s: %s load cancelled!\n", __func__, load->name);
+        modem_release_cp_nv(load);
+        return -1;
       }
 
-      if (GET_FLAG(tmp_table->flag, NV_FLAG)) {
-        MODEM_LOGD("%s: load nv\n", __func__);
-        modem_load_cp_nv(tmp_table->path_r,tmp_table->path_w);
+      if (!tmp_table->pending)
         continue;
-      }
-
-      if (GET_FLAG(tmp_table->flag, BOOT_CODE)) {
-         MODEM_LOGD("%s: load boot code\n", __func__);
-         modem_load_cp_boot_code(tmp_table->path_w);
-         continue;
-      }
 
-#if (defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) \
-            || defined(CONFIG_VBOOT_V2))
-      if (GET_FLAG(tmp_table->flag, SECURE_FLAG)) {
-        ret += secure_boot_load_img(tmp_table);
-        continue;
-      }
-#endif
-      modem_get_patiton_info(tmp_table, &load_offset, &load_size);
-      ret += modem_load_image(tmp_table, load_offset, 0, load_size);
+      if (0 == load_img_region(load, i))
+        tmp_table->pending = 0;
+      else
+        ret--;
     }
+
+    if (ret == 0)
+      break;
   }
 
+  modem_release_cp_nv(load);
   return ret;
 }
 
@@ -618,6 +825,26 @@ static void modem_load_start(int load_type) {
     modem_load_run(1, &cp_load_info);
 }
 
+/*
+ * a cancelled load leaves the images stopped,
+ * only release the write lock got by modem_load_stop.
+ */
+static void modem_load_abort(int load_type) {
+  MODEM_LOGD("%s: load_type = 0x%x!\n", __FUNCTION__, load_type);
+
+  if ((load_type & LOAD_SP_IMG) && sp_load_info.ioctrl_is_ok)
+    modem_unlock_write(sp_load_info.io_ctrl);
+
+#ifdef FEATURE_EXTERNAL_MODEM
+  if ((load_type & LOAD_DP_IMG) && dp_load_info.ioctrl_is_ok)
+    modem_unlock_write(dp_load_info.io_ctrl);
+#endif
+
+  if ((load_type & (LOAD_MODEM_IMG | LOAD_MINIAP_IMG))
+      && cp_load_info.ioctrl_is_ok)
+    modem_unlock_write(cp_load_info.io_ctrl);
+}
+
 static int modem_convert_loadinfo(
     LOAD_VALUE_S *value, modem_load_info *info) {
   modem_region_info *region = info->regions;
@@ -657,6 +884,8 @@ static void modem_load_do_set_load_info(LOAD_VALUE_S *load) {
       modem_lock_write(ioctl);
       modem_set_load_info(ioctl, &info);
       modem_unlock_write(ioctl);
+      /* readers get the same table from the state page */
+      modem_state_set_regions(load->img_type, &info);
     }
   }
 }
@@ -679,6 +908,114 @@ void modem_load_assert_modem(void) {
     modem_ioctrl_assert(cp_load_info.io_ctrl);
 }
 
+#ifdef FEATURE_PCIE_BAR_LOAD
+static void modem_load_init_bar(void) {
+  char prop[PROPERTY_VALUE_MAX] = {0};
+
+  property_get(MODEM_BAR_LOAD_PROP, prop, "0");
+  ep_bar_enable = atoi(prop) && cp_load_info.ioctrl_is_ok
+                  && cp_load_info.all_size;
+  MODEM_LOGD("%s: bar load enable = %d\n", __FUNCTION__, ep_bar_enable);
+}
+
+/* the bar will be invalid after ep rescan, must map it again */
+static void modem_load_release_bar(void) {
+  if (modem_bar_is_open(&ep_bar))
+    modem_bar_close(&ep_bar);
+}
+
+/*
+ * only the modem images(except modem head) are loaded by bar,
+ * they are loaded after ep set bar and ddr is ready,
+ * the miniap images are still written to the ioctl node.
+ */
+static int modem_load_use_bar(IMAGE_LOAD_S *img, int offsetout, uint size) {
+  char path[MAX_PATH_LEN + 1];
+  char prop[PROPERTY_VALUE_MAX] = {0};
+
+  if (!ep_bar_enable
+      || !(img->flag & MODEM_IMG_EXCPT_HEAD_FLAG)
+      || strcmp(img->path_w, cp_load_info.io_ctrl))
+    return 0;
+
+  if (!modem_bar_is_open(&ep_bar)) {
+    property_get(MODEM_BAR_INDEX_PROP, prop, "0");
+    if (modem_pcie_get_ep_resource(path, sizeof(path), atoi(prop))
+        || modem_bar_open(&ep_bar, path, cp_load_info.all_base, 0))
+      return 0;
+  }
+
+  return modem_bar_contains(&ep_bar, img->addr + offsetout, size);
+}
+
+static int modem_load_image_by_bar(IMAGE_LOAD_S* img, int offsetin,
+                                   int offsetout, uint size) {
+  int res = -1, fdin;
+  char *fin = img->path_r;
+  uint64_t addr;
+  uint n, done = img->done;
+
+  MODEM_LOGD("%s: (%s(0x%x) ==> bar(0x%lx) size=0x%x done=0x%x)\n",
+             __FUNCTION__, fin, offsetin,
+             (unsigned long)(img->addr + offsetout), size, done);
+
+  /* resume from the checkpoint */
+  if (done >= size)
+    return 0;
+  offsetin += done;
+
+  fdin = open(fin, O_RDONLY);
+  if (fdin < 0) {
+    MODEM_LOGE("failed to open %s, error: %s", fin, strerror(errno));
+    return -1;
+  }
+
+  if (lseek(fdin, offsetin, SEEK_SET) != offsetin) {
+    MODEM_LOGE("failed to lseek %d in %s", offsetin, fin);
+    close(fdin);
+    return -1;
+  }
+
+  modem_ctrl_enable_busmonitor(false);
+  modem_ctrl_enable_dmc_mpu(false);
+
+  /* the region has been cleared before the checkpoint */
+  res = 0;
+  if (GET_FLAG(img->flag, CLR_FLAG) && done == 0
+      && modem_bar_clear(&ep_bar, img->addr + offsetout, size)) {
+    MODEM_LOGE("%s: clear bar 0x%lx size 0x%x failed", __FUNCTION__,
+               (unsigned long)(img->addr + offsetout), size);
+    res = -1;
+  }
+
+  addr = img->addr + offsetout + done;
+  size -= done;
+  while (size > 0 && res == 0) {
+    if (modem_load_cancelled()) {
+      MODEM_LOGE("%s: load %s cancelled!", __FUNCTION__, fin);
+      res = -1;
+      break;
+    }
+
+    n = min(size, LOAD_CHUNK_MAX_SIZE);
+    res = modem_bar_load_fd(&ep_bar, fdin, addr, n);
+    if (res)
+      break;
+
+    img->done += n;
+    modem_load_progress_update(img->name, n);
+    addr += n;
+    size -= n;
+  }
+
+  modem_ctrl_enable_busmonitor(true);
+  modem_ctrl_enable_dmc_mpu(true);
+
+  close(fdin);
+  return res;
+}
+#endif
+
 int init_modem_img_info(void) {
 #if (defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) \
               || defined(CONFIG_VBOOT_V2))
@@ -697,10 +1034,120 @@ int init_modem_img_info(void) {
   /* if io control, set loadinfo to kernel driver*/
   modem_load_set_load_info();
 
+#ifdef FEATURE_PCIE_BAR_LOAD
+  modem_load_init_bar();
+#endif
+
   return 0;
 }
 
+static int modem_load_is_parallel(void) {
+  char prop[PROPERTY_VALUE_MAX] = {0};
+
+  property_get(MODEM_PARALLEL_LOAD_PROP, prop, "1");
+  return atoi(prop);
+}
+
+static void *modem_load_job_thread(void *arg) {
+  LOAD_JOB_S *job = (LOAD_JOB_S *)arg;
+
+  job->ret = job->func(job);
+  if (job->done)
+    job->done(job);
+  if (job->detached)
+    free(job);
+  else
+    __sync_fetch_and_add(&job->finished, 1);
+  return NULL;
+}
+
+static void modem_load_job_init(LOAD_JOB_S *job, LOAD_VALUE_S *load,
+                                uint32_t load_flag,
+                                int (*func)(LOAD_JOB_S *job)) {
+  memset(job, 0, sizeof(LOAD_JOB_S));
+  job->func = func;
+  job->load = load;
+  job->load_flag = load_flag;
+}
+
+/*
+ * run the job in a new thread if parallel, else run it here,
+ * a detached job may be freed as soon as its thread is created.
+ */
+static void modem_load_job_start(LOAD_JOB_S *job, int parallel) {
+  pthread_attr_t attr;
+  pthread_t tid;
+  int detached = job->detached;
+  int created = 0;
+
+  job->running = 0;
+  if (parallel) {
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOAD_JOB_STACK_SIZE);
+    if (detached)
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    created = (0 == pthread_create(&tid, &attr, modem_load_job_thread, job));
+    pthread_attr_destroy(&attr);
+    if (!created)
+      MODEM_LOGE("%s: create load thread(0x%x) error!", __FUNCTION__,
+                 job->load_flag);
+  }
+
+  if (!created) {
+    modem_load_job_thread(job);
+  } else if (!detached) {
+    job->tid = tid;
+    job->running = 1;
+  }
+}
+
+static int modem_load_job_wait(LOAD_JOB_S *job) {
+  if (job->running) {
+    pthread_join(job->tid, NULL);
+    job->running = 0;
+  }
+
+  return job->ret;
+}
+
+static int modem_load_job_table(LOAD_JOB_S *job) {
+  LOAD_VALUE_S *load = job->load;
+
+  if (!load->drv_is_ok && !load->ioctrl_is_ok) {
+    MODEM_LOGE("%s driver is not ok!", load->name);
+    return -1;
+  }
+
+  MODEM_LOGD("start load %s image!\n", load->name);
+  return load_img_from_table(load, job->load_flag, NONE_IMAG_FLAG);
+}
+
 #ifdef FEATURE_EXTERNAL_MODEM
+/* sp is started and verified alone, before cp and dp are stopped */
+static int modem_load_job_sp(LOAD_JOB_S *job) {
+  int ret;
+
+#if defined(CONFIG_SPRD_SECBOOT) || defined(CONFIG_VBOOT_V2)
+  /* stop action will do in TA */
+  secure_boot_set_flag(LOAD_SP_IMG);
+  secure_boot_unlock_ddr();
+#endif
+
+  modem_load_stop(LOAD_SP_IMG);
+  ret = modem_load_job_table(job);
+  if (modem_load_cancelled()) {
+    modem_load_abort(LOAD_SP_IMG);
+  } else {
+    modem_load_start(LOAD_SP_IMG);
+#if (defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) \
+    || defined(CONFIG_VBOOT_V2))
+    secure_boot_verify_all();
+#endif
+  }
+
+  return ret;
+}
+
 static int modem_load_wait_remote(LOAD_VALUE_S *load_info, int wait_bit) {
   uint32_t flag, cnt = 100;
   char *io_ctrl;
@@ -721,7 +1168,7 @@ static int modem_load_wait_remote(LOAD_VALUE_S *load_info, int wait_bit) {
       return 1; /* 1 succ */
     }
 
-    if (cnt == 0)
+    if (cnt == 0 || modem_load_cancelled())
       break;
 
     cnt--;
@@ -735,8 +1182,12 @@ static int modem_load_wait_remote(LOAD_VALUE_S *load_info, int wait_bit) {
 
 int load_spl_img(void)
 {
+  int ret = -2;
+
   MODEM_LOGD("%s!\n", __FUNCTION__);
 
+  modem_load_begin();
+
   /* clear remote flag, wait ddr ready */
   if (cp_load_info.ioctrl_is_ok) {
     modem_lock_write(cp_load_info.io_ctrl);
@@ -746,19 +1197,23 @@ int load_spl_img(void)
     if (0 != load_img_from_table(&cp_load_info, SPL_IMG_FLAG, NONE_IMAG_FLAG)) {
        MODEM_LOGE("can't load spl, stop load!");
        modem_lock_write(cp_load_info.io_ctrl);
-       return -1;
+       ret = -1;
+    } else {
+      modem_set_remote_flag(cp_load_info.io_ctrl,
+                            SPL_IMAGE_DONE_FLAG|MODEM_WARM_RESET_FLAG);
+      modem_unlock_write(cp_load_info.io_ctrl);
+      ret = 0;
     }
-
-    modem_set_remote_flag(cp_load_info.io_ctrl, SPL_IMAGE_DONE_FLAG|MODEM_WARM_RESET_FLAG);
-    modem_unlock_write(cp_load_info.io_ctrl);
-    return 0;
   }
 
-  return -2;
+  modem_load_end();
+  return ret;
 }
 
-int load_modem_img(int load_type) {
-  int start_img;
+static int modem_load_img_sync(int load_type) {
+  int start_img, parallel, ret;
+  int dp_started = 0;  /* load_type is cleared on errors */
+  LOAD_JOB_S sp_job, dp_job;
 
 #ifdef FEATURE_REMOVE_SPRD_MODEM
   load_type = LOAD_SP_IMG;
@@ -771,31 +1226,23 @@ int load_modem_img(int load_type) {
 
   MODEM_LOGD("%s: load_type = 0x%x!\n", __FUNCTION__, load_type);
 
+  /* a newer load request preempts the in-flight one */
+  modem_load_begin();
+
   /* set modem state */
   modem_ctrl_set_modem_state(MODEM_STATE_LOADING);
+  modem_load_progress_begin(load_type);
 
-  /* load sp img */
-  if (load_type & LOAD_SP_IMG) {
-#if defined(CONFIG_SPRD_SECBOOT) || defined(CONFIG_VBOOT_V2)
-    /* stop action will do in TA */
-    secure_boot_set_flag(LOAD_SP_IMG);
-    secure_boot_unlock_ddr();
-#endif
-
-    modem_load_stop(LOAD_SP_IMG);
-    if (sp_load_info.drv_is_ok ||
-      sp_load_info.ioctrl_is_ok) {
-      MODEM_LOGD("start load sp image!\n");
-      load_img_from_table(&sp_load_info, SP_IMG_FLAG, NONE_IMAG_FLAG);
-    } else {
-      MODEM_LOGE("sp driver is not ok!");
-    }
-    modem_load_start(LOAD_SP_IMG);
+  parallel = modem_load_is_parallel();
 
-#if (defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) \
-    || defined(CONFIG_VBOOT_V2))
-    secure_boot_verify_all();
-#endif
+  /*
+   * load sp img, sp is verified before cp and dp are stopped,
+   * so it's loaded alone, only dp is loaded while loading cp.
+   */
+  if (load_type & LOAD_SP_IMG) {
+    modem_load_job_init(&sp_job, &sp_load_info,
+                        SP_IMG_FLAG, modem_load_job_sp);
+    modem_load_job_start(&sp_job, 0);
 
     start_img &= (~LOAD_SP_IMG);
   }
@@ -804,13 +1251,10 @@ int load_modem_img(int load_type) {
   modem_load_stop(start_img);
   /* load dp img */
   if (load_type & LOAD_DP_IMG) {
-    if (dp_load_info.drv_is_ok ||
-      dp_load_info.ioctrl_is_ok) {
-      MODEM_LOGD("start load dp image!\n");
-      load_img_from_table(&dp_load_info, SP_IMG_FLAG, NONE_IMAG_FLAG);
-    } else {
-      MODEM_LOGIF("dp driver is not ok!");
-    }
+    modem_load_job_init(&dp_job, &dp_load_info,
+                        SP_IMG_FLAG, modem_load_job_table);
+    modem_load_job_start(&dp_job, parallel);
+    dp_started = 1;
   }
 
   /* clear remote flag, wait ddr ready */
@@ -874,6 +1318,9 @@ int load_modem_img(int load_type) {
         MODEM_LOGD("get EP_SET_BAR_DONE_FLAG!");
         /* rescan ep */
         /*  if rescan ep failed, can't load any image again */
+#ifdef FEATURE_PCIE_BAR_LOAD
+        modem_load_release_bar();
+#endif
         if (modem_rescan_ep_device())
            start_img = load_type = 0;
         else
@@ -893,17 +1340,39 @@ int load_modem_img(int load_type) {
     }
   }
 
-  /* start modem */
-  modem_load_start(start_img);
-  modem_ctrl_set_modem_state(MODEM_STATE_BOOTING);
+  /* wait the concurrent load, also after a failure cleared load_type */
+  if (dp_started)
+    modem_load_job_wait(&dp_job);
+
+#ifdef FEATURE_PCIE_BAR_LOAD
+  modem_load_release_bar();
+#endif
+
+  ret = 0;
+  if (modem_load_cancelled()) {
+    /* keep stopped, the newer request will load again */
+    MODEM_LOGE("%s: load 0x%x cancelled!\n", __FUNCTION__, load_type);
+    modem_load_abort(start_img);
+    ret = -1;
+  } else {
+    /* start modem */
+    modem_load_start(start_img);
+    modem_ctrl_set_modem_state(MODEM_STATE_BOOTING);
+  }
+
+  modem_load_progress_end(ret);
+  modem_load_end();
 
   /* release wake_lock */
   modem_ctrl_enable_wake_lock(0, __FUNCTION__);
 
-  return 0;
+  return ret;
 }
 #else
-int load_modem_img(int load_type) {
+static int modem_load_img_sync(int load_type) {
+  LOAD_JOB_S sp_job, cp_job;
+  int ret = 0;
+
   /* get wake_lock */
   modem_ctrl_enable_wake_lock(1, __FUNCTION__);
 
@@ -913,6 +1382,9 @@ int load_modem_img(int load_type) {
 
   MODEM_LOGD("%s: load_type = 0x%x!\n", __FUNCTION__, load_type);
 
+  /* a newer load request preempts the in-flight one */
+  modem_load_begin();
+
 #if defined(CONFIG_SPRD_SECBOOT) || defined(CONFIG_VBOOT_V2)
   /* stop action will do in TA */
   secure_boot_set_flag(load_type);
@@ -920,43 +1392,115 @@ int load_modem_img(int load_type) {
 #endif
   modem_load_stop(load_type);
   modem_ctrl_set_modem_state(MODEM_STATE_LOADING);
+  modem_load_progress_begin(load_type);
 
-  /* first, load sp img */
+  /* sp and cp have independent targets, load them concurrently */
   if (load_type & LOAD_SP_IMG) {
-    if (sp_load_info.drv_is_ok ||
-      sp_load_info.ioctrl_is_ok) {
-      MODEM_LOGD("start load sp image!\n");
-      load_img_from_table(&sp_load_info, SP_IMG_FLAG, NONE_IMAG_FLAG);
-    } else {
-      MODEM_LOGE("sp driver is not ok!");
-    }
+    modem_load_job_init(&sp_job, &sp_load_info,
+                        SP_IMG_FLAG, modem_load_job_table);
+    modem_load_job_start(&sp_job,
+                         (load_type & LOAD_MODEM_IMG)
+                         && modem_load_is_parallel());
   }
 
   /* than, load modem img */
   if (load_type & LOAD_MODEM_IMG) {
-    if (cp_load_info.drv_is_ok ||
-        cp_load_info.ioctrl_is_ok) {
-      MODEM_LOGD("start load cp image!\n");
-      load_img_from_table(&cp_load_info, MODEM_IMG_FLAG, NONE_IMAG_FLAG);
-    } else {
-      MODEM_LOGE("cp driver is not ok!");
-    }
+    modem_load_job_init(&cp_job, &cp_load_info,
+                        MODEM_IMG_FLAG, modem_load_job_table);
+    modem_load_job_start(&cp_job, 0);
   }
+
+  /* all images must be loaded before verify */
+  if (load_type & LOAD_SP_IMG)
+    modem_load_job_wait(&sp_job);
+
+  if (modem_load_cancelled()) {
+    /* keep stopped, the newer request will load again */
+    MODEM_LOGE("%s: load 0x%x cancelled!\n", __FUNCTION__, load_type);
+    modem_load_abort(load_type);
+    ret = -1;
+  } else {
 #if (defined(SECURE_BOOT_ENABLE) || defined(CONFIG_SPRD_SECBOOT) \
             || defined(CONFIG_VBOOT_V2))
-  secure_boot_verify_all();
+    secure_boot_verify_all();
 #endif
 
-  modem_load_start(load_type);
-  modem_ctrl_set_modem_state(MODEM_STATE_BOOTING);
+    modem_load_start(load_type);
+    modem_ctrl_set_modem_state(MODEM_STATE_BOOTING);
+  }
+
+  modem_load_progress_end(ret);
+  modem_load_end();
 
   /* release wake_lock */
   modem_ctrl_enable_wake_lock(0, __FUNCTION__);
 
-  return 0;
+  return ret;
+}
+#endif
+
+int load_modem_img(int load_type) {
+  return modem_load_img_sync(load_type);
+}
+
+/* start func in a new thread, job is NULL if nothing waits it */
+static void modem_load_job_spawn(LOAD_JOB_S *job, uint32_t load_flag,
+                                 int (*func)(LOAD_JOB_S *job),
+                                 void (*done)(LOAD_JOB_S *job), void *data) {
+  LOAD_JOB_S inline_job;
+  int detached = (NULL == job);
+
+  if (detached) {
+    job = malloc(sizeof(LOAD_JOB_S));
+    if (NULL == job) {
+      /* don't lose the load, run it here */
+      MODEM_LOGE("%s: no memory, load in the caller", __FUNCTION__);
+      job = &inline_job;
+      detached = 0;
+    }
+  }
+
+  modem_load_job_init(job, NULL, load_flag, func);
+  job->done = done;
+  job->data = data;
+  job->detached = detached;
+  modem_load_job_start(job, job != &inline_job);
+}
+
+void modem_load_job_async(LOAD_JOB_S *job, int (*func)(LOAD_JOB_S *job),
+                          void (*done)(LOAD_JOB_S *job), void *data) {
+  modem_load_job_spawn(job, 0, func, done, data);
+}
+
+static int modem_load_job_img(LOAD_JOB_S *job) {
+  return modem_load_img_sync(job->load_flag);
+}
+
+void load_modem_img_async(LOAD_JOB_S *job, int load_type,
+                          void (*done)(LOAD_JOB_S *job), void *data) {
+  modem_load_job_spawn(job, load_type, modem_load_job_img, done, data);
+}
+
+#ifdef FEATURE_EXTERNAL_MODEM
+static int modem_load_job_spl(LOAD_JOB_S *job) {
+  (void)job;
+  return load_spl_img();
+}
+
+void load_spl_img_async(LOAD_JOB_S *job, void (*done)(LOAD_JOB_S *job),
+                        void *data) {
+  modem_load_job_spawn(job, SPL_IMG_FLAG, modem_load_job_spl, done, data);
 }
 #endif
 
+int load_modem_img_poll(LOAD_JOB_S *job) {
+  return __sync_fetch_and_add(&job->finished, 0) != 0;
+}
+
+int load_modem_img_wait(LOAD_JOB_S *job) {
+  return modem_load_job_wait(job);
+}
+
 void modem_clear_region(char *fout, uint size)
 {
   int fd;
@@ -989,6 +1533,56 @@ leave:
 }
 
 
+/* EINTR/EAGAIN or no progress, retry with backoff, return 0 if give up */
+static int modem_load_retry(int *retry, const char *path) {
+  if (*retry >= LOAD_RETRY_MAX || modem_load_cancelled())
+    return 0;
+
+  MODEM_LOGE("%s: %s retry %d, error: %s", __FUNCTION__, path, *retry,
+             strerror(errno));
+  usleep(LOAD_RETRY_DELAY_US << *retry);
+  (*retry)++;
+  return 1;
+}
+
+static int modem_load_read(int fd, char *buf, int size, const char *path) {
+  int n, retry = 0;
+
+  do {
+    n = read(fd, buf, size);
+    if (n >= 0)
+      return n;
+  } while ((errno == EINTR || errno == EAGAIN)
+           && modem_load_retry(&retry, path));
+
+  return n;
+}
+
+/* write all data, short write continues, return the written size */
+static int modem_load_write(int fd, const char *buf, int size,
+                            const char *path) {
+  int n, done = 0, retry = 0;
+
+  while (done < size) {
+    n = write(fd, buf + done, size - done);
+    if (n > 0) {
+      done += n;
+      continue;
+    }
+
+    if (n < 0 && errno != EINTR && errno != EAGAIN)
+      break;
+    if (!modem_load_retry(&retry, path))
+      break;
+  }
+
+  return done;
+}
+
+/*
+ * img->done is the checkpoint of the region, the load starts from it,
+ * and it's updated with the written size, so a failed load can resume.
+ */
 int modem_load_image(IMAGE_LOAD_S* img, int offsetin, int offsetout,
                     uint size) {
   int res = -1, fdin, fdout, rsize, rrsize, wsize;
@@ -999,28 +1593,45 @@ int modem_load_image(IMAGE_LOAD_S* img, int offsetin, int offsetout,
   char *fout= img->path_w;
   char *buf;
 
+#ifdef FEATURE_PCIE_BAR_LOAD
+  if (modem_load_use_bar(img, offsetout, size))
+    return modem_load_image_by_bar(img, offsetin, offsetout, size);
+#endif
+
   buf_size = sizeof(buf_stack);
   buf = buf_stack;
 
   if (size > buf_size) {
-    buf_heap = malloc(size);
+    /* keep a cancel check every LOAD_CHUNK_MAX_SIZE */
+    buf_heap = malloc(min(size, LOAD_CHUNK_MAX_SIZE));
     if (buf_heap) {
-      buf_size = size;
+      buf_size = min(size, LOAD_CHUNK_MAX_SIZE);
       buf = buf_heap;
     }
   }
 
-  MODEM_LOGD("%s: (%s(0x%x) ==> %s(0x%x) size=0x%x)\n",
+  MODEM_LOGD("%s: (%s(0x%x) ==> %s(0x%x) size=0x%x done=0x%x)\n",
              __FUNCTION__, fin, offsetin,
-             fout, offsetout, size);
+             fout, offsetout, size, img->done);
+
+  if (img->done >= size) {
+    if (buf_heap)
+      free(buf_heap);
+    return 0;
+  }
 
   modem_ctrl_enable_busmonitor(false);
   modem_ctrl_enable_dmc_mpu(false);
 
-  if (GET_FLAG(img->flag, CLR_FLAG)) {
+  /* the region has been cleared before the checkpoint */
+  if (GET_FLAG(img->flag, CLR_FLAG) && img->done == 0) {
     modem_clear_region(fout, size);
   }
 
+  offsetin += img->done;
+  offsetout += img->done;
+  size -= img->done;
+
   fdin = open(fin, O_RDONLY);
   if (fdin < 0) {
     MODEM_LOGE("failed to open %s, error: %s", fin, strerror(errno));
@@ -1049,19 +1660,29 @@ int modem_load_image(IMAGE_LOAD_S* img, int offsetin, int offsetout,
   }
 
   do {
+    if (modem_load_cancelled()) {
+      MODEM_LOGE("%s: load %s cancelled!", __FUNCTION__, fin);
+      goto leave;
+    }
+
     rsize = min(size, buf_size);
-    rrsize = read(fdin, buf, rsize);
+    rrsize = modem_load_read(fdin, buf, rsize, fin);
     if (rrsize == 0) goto leave;
     if (rrsize < 0) {
       MODEM_LOGE("failed to read %s %s", fin, strerror(errno));
       goto leave;
     }
-    wsize = write(fdout, buf, rrsize);
+    wsize = modem_load_write(fdout, buf, rrsize, fout);
 
     MODEM_LOGIF("write %s [wsize=%d, rsize=%d, remain=%d]", fout, wsize, rsize,
                 size);
 
-    if (wsize <= 0) {
+    if (wsize > 0) {
+      img->done += wsize;
+      modem_load_progress_update(img->name, wsize);
+    }
+
+    if (wsize < rrsize) {
       MODEM_LOGE("failed to write %s [wsize=%d, rsize=%d, remain=%d]", fout,
                  wsize, rsize, size);
       goto leave;
@@ -1269,6 +1890,13 @@ void modem_reboot_all_modem(void) {
   }
 #endif
 
+  /* the in-flight load is pointless, don't rescan under it */
+  modem_load_begin();
+
+#ifdef FEATURE_PCIE_BAR_LOAD
+  modem_load_release_bar();
+#endif
+
 #ifdef FEATURE_PCIE_RESCAN
   do {
     /*  if rescan ep failed, can't load, continue rescan */
@@ -1281,6 +1909,8 @@ void modem_reboot_all_modem(void) {
   if (cp_load_info.ioctrl_is_ok)
     modem_ioctrl_reboot_ext_modem(cp_load_info.io_ctrl);
 
+  modem_load_end();
+
   load_modem_img(LOADL_ALL_EXTERNAL_IMG);
 }
 #endif
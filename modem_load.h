@@ -6,6 +6,8 @@
  #ifndef MODEM_LOAD_H_
 #define MODEM_LOAD_H_
 
+#include <pthread.h>
+
 /* modem/dsp partition, in here, will config them enough big */
 #define MODEM_SIZE (20 * 1024 * 1024)
 #define DELTANV_SIZE (1 * 1024 * 1024)
@@ -81,6 +83,8 @@
 #define SET_2FLAG(flag, bit1, bit2) ((flag) = (flag) | (1 << (bit1)) | (1 << (bit2)))
 #define GET_FLAG(flag, bit) ((flag) & (1 << (bit)))
 
+ struct nv_partition;
+
  typedef struct image_load {
   char path_w[MAX_PATH_LEN + 1];
   char path_r[MAX_PATH_LEN + 1];
@@ -88,6 +92,9 @@
   uint64_t addr;
   uint32_t size;
   uint32_t flag;
+  uint32_t done;  /* checkpoint: loaded size of the region */
+  int pending;    /* the region is not loaded yet */
+  struct nv_partition *nv;  /* nv check started ahead */
 } IMAGE_LOAD_S;
 
 enum {
@@ -169,11 +176,42 @@ typedef struct load_node_info {
     uint32_t size;
 }LOAD_NODE_INFO;
 
+/* a load runs as a job, in the caller thread or a new thread */
+typedef struct load_job {
+  int (*func)(struct load_job *job);
+  LOAD_VALUE_S *load;
+  uint32_t load_flag;
+  pthread_t tid;
+  int running;
+  int ret;
+  volatile int finished;  /* func has returned, ret is its result */
+  int detached;           /* no handle, freed when it finishes */
+  void (*done)(struct load_job *job);  /* on the job thread at the end */
+  void *data;
+} LOAD_JOB_S;
+
 void modem_load_assert_modem(void);
+void modem_load_cancel(const char *reason);
 int init_modem_img_info(void);
 int load_modem_img(int load_type);
 int load_spl_img(void);
 
+/*
+ * the async loads, func runs in a new thread and done is called there
+ * when it ends. job is the completion handle, poll or wait it and wait
+ * it before reuse. With a NULL job nothing waits, only done tells the end.
+ */
+void modem_load_job_async(LOAD_JOB_S *job, int (*func)(LOAD_JOB_S *job),
+                          void (*done)(LOAD_JOB_S *job), void *data);
+void load_modem_img_async(LOAD_JOB_S *job, int load_type,
+                          void (*done)(LOAD_JOB_S *job), void *data);
+void load_spl_img_async(LOAD_JOB_S *job, void (*done)(LOAD_JOB_S *job),
+                        void *data);
+/* 1 if the job has finished */
+int load_modem_img_poll(LOAD_JOB_S *job);
+/* wait the job to finish, return its result */
+int load_modem_img_wait(LOAD_JOB_S *job);
+
 void modem_get_patiton_info(IMAGE_LOAD_S *img,
   unsigned int *boot_offset, size_t *size);
 int modem_load_image(IMAGE_LOAD_S* img,
@@ -0,0 +1,210 @@
+/*
+ *  modem_pcie_bar.c - load image to ep memory by the mapped pcie bar.
+ *
+ *  The ep memory window is exposed as sys/bus/pci/devices/xxx/resourceN,
+ *  after mmap it, the image can be copied to ep directly instead of
+ *  write() every byte to the ioctl node and let the driver copy it.
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "modem_control.h"
+#include "modem_pcie_bar.h"
+
+#define BAR_BUF_SIZE (512 * 1024)
+
+static void modem_bar_reset(MODEM_BAR_S *bar) {
+  bar->fd = -1;
+  bar->base = NULL;
+  bar->size = 0;
+  bar->phys = 0;
+}
+
+int modem_bar_open(MODEM_BAR_S *bar, const char *path,
+                   uint64_t phys, size_t size) {
+  struct stat st;
+  void *base;
+  int fd;
+
+  modem_bar_reset(bar);
+
+  fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+  if (fd < 0) {
+    MODEM_LOGE("%s: open %s failed, error: %s", __FUNCTION__, path,
+               strerror(errno));
+    return -1;
+  }
+
+  /* sysfs resource file size is the bar length */
+  if (size == 0) {
+    if (fstat(fd, &st) || st.st_size <= 0) {
+      MODEM_LOGE("%s: can't get size of %s", __FUNCTION__, path);
+      close(fd);
+      return -1;
+    }
+    size = st.st_size;
+  }
+
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    MODEM_LOGE("%s: mmap %s size 0x%zx failed, error: %s", __FUNCTION__,
+               path, size, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  bar->fd = fd;
+  bar->base = base;
+  bar->size = size;
+  bar->phys = phys;
+
+  MODEM_LOGD("%s: %s phys=0x%lx, size=0x%zx", __FUNCTION__,
+             path, (unsigned long)phys, size);
+  return 0;
+}
+
+void modem_bar_close(MODEM_BAR_S *bar) {
+  if (bar->base)
+    munmap(bar->base, bar->size);
+  if (bar->fd >= 0)
+    close(bar->fd);
+
+  modem_bar_reset(bar);
+}
+
+int modem_bar_is_open(const MODEM_BAR_S *bar) {
+  return bar->base != NULL;
+}
+
+int modem_bar_contains(const MODEM_BAR_S *bar, uint64_t addr, size_t size) {
+  if (!bar->base || addr < bar->phys)
+    return 0;
+
+  return (addr - bar->phys) <= bar->size &&
+         size <= bar->size - (addr - bar->phys);
+}
+
+/*
+ * the ep memory is uncached on ap side, so write it with
+ * 16-byte aligned streaming stores, which won't pollute the cache
+ * and can be combined into full pcie write transactions.
+ */
+void modem_bar_copy(void *dst, const void *src, size_t len) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+
+  /* head: byte copy until dst is aligned */
+  while (len && ((uintptr_t)d & (MODEM_BAR_ALIGN - 1))) {
+    *(volatile uint8_t *)d++ = *s++;
+    len--;
+  }
+
+#if defined(__aarch64__)
+  while (len >= 32) {
+    asm volatile("ldp q0, q1, [%1]\n\t"
+                 "stnp q0, q1, [%0]\n\t"
+                 :: "r"(d), "r"(s) : "v0", "v1", "memory");
+    d += 32;
+    s += 32;
+    len -= 32;
+  }
+#elif defined(__SSE2__)
+  while (len >= 16) {
+    _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    d += 16;
+    s += 16;
+    len -= 16;
+  }
+  _mm_sfence();
+#else
+  while (len >= 8) {
+    uint64_t v;
+
+    memcpy(&v, s, sizeof(v));
+    *(volatile uint64_t *)d = v;
+    d += 8;
+    s += 8;
+    len -= 8;
+  }
+#endif
+
+  /* tail */
+  while (len--)
+    *(volatile uint8_t *)d++ = *s++;
+
+  __sync_synchronize();
+}
+
+int modem_bar_clear(MODEM_BAR_S *bar, uint64_t addr, size_t size) {
+  uint8_t *dst;
+  void *zero;
+  size_t n;
+
+  if (!modem_bar_contains(bar, addr, size))
+    return -1;
+
+  if (posix_memalign(&zero, MODEM_BAR_ALIGN, BAR_BUF_SIZE))
+    return -1;
+
+  memset(zero, 0, BAR_BUF_SIZE);
+  dst = (uint8_t *)bar->base + (addr - bar->phys);
+  while (size > 0) {
+    n = min(size, BAR_BUF_SIZE);
+    modem_bar_copy(dst, zero, n);
+    dst += n;
+    size -= n;
+  }
+
+  free(zero);
+  return 0;
+}
+
+int modem_bar_load_fd(MODEM_BAR_S *bar, int fdin, uint64_t addr, size_t size) {
+  uint8_t *dst;
+  void *buf;
+  ssize_t rsize;
+  size_t n;
+  int res = -1;
+
+  if (!modem_bar_contains(bar, addr, size)) {
+    MODEM_LOGE("%s: [0x%lx, 0x%zx] out of bar window", __FUNCTION__,
+               (unsigned long)addr, size);
+    return -1;
+  }
+
+  /* aligned bounce buffer, so the streaming load side is aligned too */
+  if (posix_memalign(&buf, MODEM_BAR_ALIGN, BAR_BUF_SIZE)) {
+    MODEM_LOGE("%s: alloc buf failed!", __FUNCTION__);
+    return -1;
+  }
+
+  dst = (uint8_t *)bar->base + (addr - bar->phys);
+  while (size > 0) {
+    n = min(size, BAR_BUF_SIZE);
+    rsize = read(fdin, buf, n);
+    if (rsize < 0 && errno == EINTR)
+      continue;
+    if (rsize <= 0) {
+      MODEM_LOGE("%s: read return %zd, remain=0x%zx, error: %s",
+                 __FUNCTION__, rsize, size, strerror(errno));
+      goto leave;
+    }
+
+    modem_bar_copy(dst, buf, rsize);
+    dst += rsize;
+    size -= rsize;
+  }
+  res = 0;
+
+leave:
+  free(buf);
+  return res;
+}
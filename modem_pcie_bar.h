@@ -0,0 +1,39 @@
+/*
+ *  modem_pcie_bar.h - load image to ep memory by the mapped pcie bar.
+ *
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#ifndef _MODEM_PCIE_BAR_H
+#define _MODEM_PCIE_BAR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MODEM_BAR_ALIGN 16
+
+typedef struct modem_bar {
+  int fd;
+  void *base;     /* mapped window */
+  size_t size;    /* mapped size */
+  uint64_t phys;  /* ep address mapped at window offset 0 */
+} MODEM_BAR_S;
+
+/*
+ * map the bar resource (or any plain file standing in for it),
+ * size 0 means map the whole resource.
+ */
+int modem_bar_open(MODEM_BAR_S *bar, const char *path,
+                   uint64_t phys, size_t size);
+void modem_bar_close(MODEM_BAR_S *bar);
+int modem_bar_is_open(const MODEM_BAR_S *bar);
+int modem_bar_contains(const MODEM_BAR_S *bar, uint64_t addr, size_t size);
+
+/* aligned, non-temporal copy into the mapped window */
+void modem_bar_copy(void *dst, const void *src, size_t len);
+
+int modem_bar_clear(MODEM_BAR_S *bar, uint64_t addr, size_t size);
+int modem_bar_load_fd(MODEM_BAR_S *bar, int fdin, uint64_t addr, size_t size);
+
+#endif /* _MODEM_PCIE_BAR_H */
@@ -39,6 +39,7 @@
 
 #define PCIE_EP_REMOVE_DEV "remove"
 #define PCIE_EP_RESCAN_DEV "rescan"
+#define PCIE_EP_RESOURCE_DEV "resource"
 
 #define MAX_EP_PATH_LEN 128
 
@@ -283,6 +284,26 @@ int modem_rescan_ep_device(void)
 #endif
 }
 
+/* get sys/bus/pci/devices/xxx/resourceN of the ep device */
+int modem_pcie_get_ep_resource(char *path, int size, int bar)
+{
+  char *dev;
+
+  if (!device_remove_path[0] && modem_init_ep_device_path())
+    return -1;
+
+  /* the device remove path is ".../devices/xxx/remove" */
+  dev = strrchr(device_remove_path, '/');
+  if (!dev)
+    return -1;
+
+  snprintf(path, size, "%.*s/%s%d", (int)(dev - device_remove_path),
+           device_remove_path, PCIE_EP_RESOURCE_DEV, bar);
+  MODEM_LOGD("%s: %s", __FUNCTION__, path);
+
+  return 0;
+}
+
 static void modem_pcie_event(BaseUEventInfo *info, void *data)
 {
   char path[MAX_EP_PATH_LEN];
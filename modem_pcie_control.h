@@ -14,5 +14,6 @@
 
 int modem_rescan_ep_device(void);
 void modem_chane_ep_device_owner(void);
+int modem_pcie_get_ep_resource(char *path, int size, int bar);
 
 #endif /* _MODEM_PCIE_CONTROL_H */
@@ -0,0 +1,224 @@
+/*
+ *  modem_state.c - the modem state, published in the state page.
+ *
+ *  The state used to be kept twice, by modem_control and by the
+ *  client connection, now both use this one. It's published with the
+ *  last assert, the counters, the load timing and the region tables
+ *  in a memfd page, clients map an O_RDONLY fd of it and read it under
+ *  the seqlock without asking modemd. After modemd maps it the memfd is
+ *  sealed with F_SEAL_FUTURE_WRITE, so no one can write it but modemd.
+ *  Kernels before 5.1 don't have that seal, there a client can reopen
+ *  /proc/<pid>/fd/<n> of its fd O_RDWR and write the page.
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "modem_control.h"
+#include "modem_state.h"
+#include "modem_state_page.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#if defined(F_ADD_SEALS) && !defined(F_SEAL_FUTURE_WRITE)
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+_Static_assert(sizeof(struct modem_state_page) <= MODEM_STATE_PAGE_SIZE,
+               "modem state page overflow");
+
+static pthread_mutex_t s_stateMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_state = MODEM_STATE_INIT;
+/* the memfd page, or s_localPage if it can't be created */
+static struct modem_state_page s_localPage;
+static struct modem_state_page *s_page = &s_localPage;
+static int s_pageFd = -1;
+
+static uint64_t modem_state_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* seqlock write side, with s_stateMutex held */
+static void modem_state_write_begin(void) {
+  __atomic_store_n(&s_page->seq, s_page->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void modem_state_write_end(void) {
+  __atomic_store_n(&s_page->seq, s_page->seq + 1, __ATOMIC_RELEASE);
+}
+
+int modem_state_init(void) {
+  struct modem_state_page *page;
+  char path[64];
+  int fd, rfd;
+
+  fd = syscall(__NR_memfd_create, "modem_state",
+               MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    MODEM_LOGE("%s: memfd_create error: %s", __FUNCTION__, strerror(errno));
+    return -1;
+  }
+
+  if (ftruncate(fd, MODEM_STATE_PAGE_SIZE) < 0) {
+    MODEM_LOGE("%s: ftruncate error: %s", __FUNCTION__, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  page = mmap(NULL, MODEM_STATE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+              fd, 0);
+  if (page == MAP_FAILED) {
+    MODEM_LOGE("%s: mmap error: %s", __FUNCTION__, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+#ifdef F_ADD_SEALS
+  /*
+   * a client can't resize it, nor write it or map it writable, even
+   * through a reopen of /proc/<pid>/fd, only the mapping above writes.
+   */
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+            F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+    /* no F_SEAL_FUTURE_WRITE before 5.1, the page is writable by clients */
+    MODEM_LOGE("%s: seal write error: %s", __FUNCTION__, strerror(errno));
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  }
+#endif
+
+  /* a new open file of the memfd, the clients don't get fd's O_RDWR */
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  rfd = open(path, O_RDONLY | O_CLOEXEC);
+  close(fd);
+  if (rfd < 0) {
+    MODEM_LOGE("%s: open %s error: %s", __FUNCTION__, path, strerror(errno));
+    munmap(page, MODEM_STATE_PAGE_SIZE);
+    return -1;
+  }
+
+  pthread_mutex_lock(&s_stateMutex);
+  memcpy(page, &s_localPage, sizeof(*page));
+  page->magic = MODEM_STATE_PAGE_MAGIC;
+  page->version = MODEM_STATE_PAGE_VERSION;
+  page->size = sizeof(*page);
+  page->seq &= ~1u;
+  page->state = s_state;
+  s_page = page;
+  s_pageFd = rfd;
+  pthread_mutex_unlock(&s_stateMutex);
+
+  MODEM_LOGD("%s: state page fd %d", __FUNCTION__, rfd);
+  return 0;
+}
+
+int modem_state_page_fd(void) {
+  return s_pageFd;
+}
+
+/* with s_stateMutex held */
+static void modem_state_do_set(int state) {
+  if (state == s_state)
+    return;
+
+  modem_state_write_begin();
+  if (state == MODEM_STATE_RESET)
+    s_page->reset_count++;
+  else if (state == MODEM_STATE_ASSERT)
+    s_page->assert_count++;
+  s_page->state = state;
+  s_page->state_time = modem_state_now_ns();
+  modem_state_write_end();
+
+  __atomic_store_n(&s_state, state, __ATOMIC_RELEASE);
+}
+
+void modem_state_set(int state) {
+  pthread_mutex_lock(&s_stateMutex);
+  modem_state_do_set(state);
+  pthread_mutex_unlock(&s_stateMutex);
+}
+
+int modem_state_get(void) {
+  return __atomic_load_n(&s_state, __ATOMIC_ACQUIRE);
+}
+
+int modem_state_transit(int from, int to) {
+  int ret = 0;
+
+  pthread_mutex_lock(&s_stateMutex);
+  if (s_state == from) {
+    modem_state_do_set(to);
+    ret = 1;
+  }
+  pthread_mutex_unlock(&s_stateMutex);
+
+  return ret;
+}
+
+void modem_state_read(struct modem_state_page *copy) {
+  pthread_mutex_lock(&s_stateMutex);
+  memcpy(copy, s_page, sizeof(*copy));
+  pthread_mutex_unlock(&s_stateMutex);
+}
+
+void modem_state_set_event(uint32_t seq, const char *assert_info) {
+  pthread_mutex_lock(&s_stateMutex);
+  modem_state_write_begin();
+  s_page->event_seq = seq;
+  if (assert_info) {
+    strncpy(s_page->last_assert, assert_info, MODEM_STATE_ASSERT_LEN - 1);
+    s_page->last_assert[MODEM_STATE_ASSERT_LEN - 1] = '\0';
+  }
+  modem_state_write_end();
+  pthread_mutex_unlock(&s_stateMutex);
+}
+
+void modem_state_set_load(int type, int ret, uint32_t done_kb,
+                          uint32_t time_ms) {
+  pthread_mutex_lock(&s_stateMutex);
+  modem_state_write_begin();
+  s_page->load_type = type;
+  s_page->load_ret = ret;
+  s_page->load_done_kb = done_kb;
+  s_page->load_time_ms = time_ms;
+  modem_state_write_end();
+  pthread_mutex_unlock(&s_stateMutex);
+}
+
+void modem_state_set_regions(int system, const modem_load_info *info) {
+  struct modem_state_load_info *dst;
+  uint32_t i, cnt;
+
+  if (system < 0 || system >= MODEM_STATE_SYS_NUM)
+    return;
+  cnt = min(info->region_cnt, MODEM_STATE_REGION_CNT);
+
+  pthread_mutex_lock(&s_stateMutex);
+  modem_state_write_begin();
+  dst = &s_page->load_info[system];
+  memset(dst, 0, sizeof(*dst));
+  dst->region_cnt = cnt;
+  dst->modem_base = info->modem_base;
+  dst->modem_size = info->modem_size;
+  dst->all_base = info->all_base;
+  dst->all_size = info->all_size;
+  for (i = 0; i < cnt; i++) {
+    dst->regions[i].address = info->regions[i].address;
+    dst->regions[i].size = info->regions[i].size;
+    strncpy(dst->regions[i].name, info->regions[i].name,
+            MODEM_STATE_REGION_NAME_LEN);
+  }
+  modem_state_write_end();
+  pthread_mutex_unlock(&s_stateMutex);
+}
@@ -0,0 +1,36 @@
+/*
+ *  modem_state.h - the modem state, published in the state page.
+ *
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#ifndef _MODEM_STATE_H
+#define _MODEM_STATE_H
+
+#include <stdint.h>
+
+#include "modem_io_control.h"
+
+struct modem_state_page;
+
+/* create the page, the state is still kept if it fails */
+int modem_state_init(void);
+/* the O_RDONLY fd passed to clients, -1 if there is no page */
+int modem_state_page_fd(void);
+
+void modem_state_set(int state);
+int modem_state_get(void);
+/* set to if the state is from, 1 if it's changed */
+int modem_state_transit(int from, int to);
+/* a consistent copy of the page */
+void modem_state_read(struct modem_state_page *copy);
+
+/* a broadcast, assert_info is the text of an assert or NULL */
+void modem_state_set_event(uint32_t seq, const char *assert_info);
+void modem_state_set_load(int type, int ret, uint32_t done_kb,
+                          uint32_t time_ms);
+/* system is IMAGE_CP, IMAGE_SP or IMAGE_DP */
+void modem_state_set_regions(int system, const modem_load_info *info);
+
+#endif /* _MODEM_STATE_H */
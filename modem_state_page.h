@@ -0,0 +1,109 @@
+/**
+ * modem_state_page.h --- the modem state page published by modemd.
+ *
+ * modemd keeps the modem state in one page of a memfd, a client gets an
+ * O_RDONLY fd of it over the modemd or modemd_v2 socket, with the
+ * SCM_RIGHTS of the reply to "Modem State Page" (a MODEM_EVENT_STATE_PAGE
+ * record on modemd_v2), maps it with PROT_READ and reads it at any time
+ * without a syscall.
+ *
+ * The memfd is sealed with F_SEAL_FUTURE_WRITE where the kernel has it
+ * (5.1 and later), then only modemd can write the page. On older
+ * kernels a client can reopen the fd writable through /proc and write
+ * it, so a reader checks magic, version and size and takes the content
+ * as a hint, not as something another client can't have changed.
+ *
+ * The page is guarded by a seqlock, seq is odd while modemd writes it,
+ * a reader copies the page with modem_state_page_read() which retries
+ * until it gets a copy that wasn't written meanwhile.
+ *
+ * Copyright (C) 2019 Spreadtrum Communications Inc.
+ */
+#ifndef MODEM_STATE_PAGE_H_
+#define MODEM_STATE_PAGE_H_
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MODEM_STATE_PAGE_MAGIC 0x4d535047  /* "MSPG" */
+#define MODEM_STATE_PAGE_VERSION 1
+#define MODEM_STATE_PAGE_SIZE 4096
+#define MODEM_STATE_ASSERT_LEN 256
+/* same as the modem_load_info of the ioctl */
+#define MODEM_STATE_REGION_CNT 20
+#define MODEM_STATE_REGION_NAME_LEN 20
+/* reads that overlap a write before giving up */
+#define MODEM_STATE_READ_RETRY 1000
+
+enum {
+  MODEM_STATE_SYS_CP = 0,
+  MODEM_STATE_SYS_SP,
+  MODEM_STATE_SYS_DP,
+  MODEM_STATE_SYS_NUM
+};
+
+struct modem_state_region {
+  uint64_t address;
+  uint32_t size;
+  char name[MODEM_STATE_REGION_NAME_LEN + 4];  /* NUL terminated */
+};
+
+/* the region table modemd set to the ioctl node of a system */
+struct modem_state_load_info {
+  uint32_t region_cnt;   /* 0 until modemd sets it */
+  uint32_t modem_size;
+  uint64_t modem_base;
+  uint64_t all_base;
+  uint32_t all_size;
+  uint32_t reserved;
+  struct modem_state_region regions[MODEM_STATE_REGION_CNT];
+};
+
+struct modem_state_page {
+  uint32_t magic;          /* MODEM_STATE_PAGE_MAGIC */
+  uint16_t version;        /* MODEM_STATE_PAGE_VERSION */
+  uint16_t size;           /* sizeof(struct modem_state_page) */
+  uint32_t seq;            /* seqlock, odd while modemd writes */
+  /*
+   * 0 init, 1 loading, 2 booting, 3 alive, 4 assert, 5 block,
+   * 6 reset, 7 reboot external modem, 8 reboot system
+   */
+  int32_t state;
+  uint64_t state_time;     /* CLOCK_BOOTTIME in ns of the last change */
+  uint32_t event_seq;      /* seq of the last broadcast */
+  uint32_t reset_count;
+  uint32_t assert_count;
+  /* the last image load */
+  int32_t load_type;       /* LOAD_*_IMG bits */
+  int32_t load_ret;
+  uint32_t load_done_kb;
+  uint32_t load_time_ms;
+  uint32_t reserved;
+  char last_assert[MODEM_STATE_ASSERT_LEN];
+  struct modem_state_load_info load_info[MODEM_STATE_SYS_NUM];
+};
+
+/* copy the page, 0 or -1 if modemd kept writing it */
+static inline int modem_state_page_read(const struct modem_state_page *page,
+                                        struct modem_state_page *copy) {
+  uint32_t seq;
+  int retry;
+
+  for (retry = 0; retry < MODEM_STATE_READ_RETRY; retry++) {
+    seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+
+    memcpy(copy, page, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+      return 0;
+  }
+
+  return -1;
+}
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ *  nv_bench.c - nv checksum and read benchmark, runs on host.
+ *
+ *  Generates synthetic nv partitions(healthy, org damaged, both damaged),
+ *  times the checksum kernels and read_nv_partition() on them from
+ *  64KB to 2MB, and checks the results against the reference checksums.
+ *
+ *  usage: modem_nv_bench [-d dir] [-n loops]
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "nv_checksum.h"
+#include "nv_read.h"
+
+#define NV_BENCH_SECT_SIZE 512
+#define NV_BENCH_MAGIC 0x00004e56
+#define NV_BENCH_LOOPS 20
+#define NV_BENCH_PATH_LEN 128
+
+/* same layout as nv_header_t in nv_read.c */
+typedef struct {
+  uint32_t magic;
+  uint32_t len;
+  uint32_t checksum;
+  uint32_t version;
+} nv_bench_header_t;
+
+enum {
+  NV_LAYOUT_HEALTHY = 0,
+  NV_LAYOUT_SINGLE,  /* org damaged, repaired from bak */
+  NV_LAYOUT_DOUBLE,  /* both damaged */
+  NV_LAYOUT_NUM
+};
+
+static const char *layout_name[NV_LAYOUT_NUM] = {
+  "healthy", "single-corrupt", "double-corrupt"
+};
+
+static const uint32_t bench_size[] = {
+  64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024
+};
+
+/* the daemon switches them around the nv output */
+void modem_ctrl_enable_busmonitor(bool bEnable) { (void)bEnable; }
+void modem_ctrl_enable_dmc_mpu(bool bEnable) { (void)bEnable; }
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t ns) {
+  return ns ? (double)bytes * 1000.0 / ns : 0;
+}
+
+static void fill_random(uint8_t *buf, uint32_t len, uint32_t seed) {
+  uint32_t i;
+
+  /* xorshift, the content only has to be repeatable */
+  for (i = 0; i < len; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    buf[i] = (uint8_t)seed;
+  }
+}
+
+/* write one copy, flip a data byte after the checksum if damaged */
+static int make_copy(const char *path, const uint8_t *data, uint32_t len,
+                     bool damaged) {
+  uint8_t sect[NV_BENCH_SECT_SIZE];
+  nv_bench_header_t *header = (nv_bench_header_t *)sect;
+  uint8_t saved = 0;
+  int fd, ret = -1;
+
+  memset(sect, 0, sizeof(sect));
+  header->magic = NV_BENCH_MAGIC;
+  header->len = len;
+  header->checksum = calc_Checksum((unsigned char *)data, len);
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed\n", path);
+    return -1;
+  }
+
+  if (damaged) {
+    saved = data[len / 2];
+    ((uint8_t *)data)[len / 2] = saved ^ 0x5a;
+  }
+  if (write(fd, sect, sizeof(sect)) == sizeof(sect) &&
+      write(fd, data, len) == (ssize_t)len)
+    ret = 0;
+  if (damaged)
+    ((uint8_t *)data)[len / 2] = saved;
+
+  close(fd);
+  return ret;
+}
+
+static int make_partition(const char *org, const char *bak, const char *out,
+                          const uint8_t *data, uint32_t len, int layout) {
+  int fd;
+
+  if (make_copy(org, data, len, layout != NV_LAYOUT_HEALTHY) ||
+      make_copy(bak, data, len, layout == NV_LAYOUT_DOUBLE))
+    return -1;
+
+  /* read_nv_partition doesn't create the output */
+  fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  close(fd);
+  return 0;
+}
+
+static int check_output(const char *out, const uint8_t *data, uint32_t len) {
+  uint8_t *buf;
+  int fd, ok;
+
+  buf = malloc(len + 1);
+  if (NULL == buf)
+    return 0;
+
+  fd = open(out, O_RDONLY);
+  ok = fd >= 0 && read(fd, buf, len + 1) == (ssize_t)len &&
+       !memcmp(buf, data, len);
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  return ok;
+}
+
+static int verify_one(const nv_checksum_kernel_t *kernels, int num,
+                      const uint8_t *dat, uint32_t len) {
+  unsigned short ref = calc_Checksum((unsigned char *)dat, len);
+  unsigned short ref64 = calc_Checksum64((unsigned char *)dat, len);
+  unsigned short ecc, ecc64;
+  uint64_t sum;
+  int k;
+
+  for (k = 0; k < num; k++) {
+    sum = kernels[k].sum(dat, len);
+    if (nv_checksum_fold32(sum) != ref || nv_checksum_fold64(sum) != ref64) {
+      fprintf(stderr, "checksum %s mismatch at len %u offset %u\n",
+              kernels[k].name, len, (unsigned)((uintptr_t)dat & 63));
+      return -1;
+    }
+  }
+
+  nv_checksum_calc(dat, len, &ecc, &ecc64);
+  if (ecc != ref || ecc64 != ref64) {
+    fprintf(stderr, "nv_checksum_calc mismatch at len %u\n", len);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * every kernel the cpu runs must be bit exact with both references:
+ * all short lengths, lengths around the vector and neon block sizes,
+ * unaligned starts, and all 0xff data whose 32bit sum wraps
+ * (more than 2^32 / 0xffff words, about 128KB).
+ */
+static int bench_verify(const uint8_t *random, uint32_t max_len) {
+  static const uint32_t big_len[] = {
+    128 * 1024 - 1, 128 * 1024 + 4, 256 * 1024 - 2, 256 * 1024 + 17,
+    1024 * 1024 + 33, 2048 * 1024 - 64
+  };
+  static const uint32_t big_off[] = { 0, 1, 2, 3, 7, 15, 31, 63 };
+  nv_checksum_kernel_t kernels[4];
+  const uint8_t *pattern[2];
+  uint8_t *ones;
+  uint32_t len, off;
+  size_t i, j;
+  int num, p, ret = 0;
+
+  num = nv_checksum_kernels(kernels, sizeof(kernels) / sizeof(kernels[0]));
+
+  /* room for the longest length at the largest offset */
+  ones = malloc(max_len);
+  if (NULL == ones)
+    return -1;
+  memset(ones, 0xff, max_len);
+  pattern[0] = random;
+  pattern[1] = ones;
+
+  for (p = 0; p < 2 && !ret; p++) {
+    for (len = 0; len < 512 && !ret; len++)
+      for (off = 0; off < 64 && !ret; off++)
+        ret = verify_one(kernels, num, pattern[p] + off, len);
+
+    for (i = 0; i < sizeof(big_len) / sizeof(big_len[0]) && !ret; i++)
+      for (j = 0; j < sizeof(big_off) / sizeof(big_off[0]) && !ret; j++)
+        if (big_len[i] + big_off[j] <= max_len)
+          ret = verify_one(kernels, num, pattern[p] + big_off[j], big_len[i]);
+  }
+
+  free(ones);
+  printf("  verify   %d kernels:", num);
+  for (p = 0; p < num; p++)
+    printf(" %s", kernels[p].name);
+  printf("  %s\n", ret ? "mismatch" : "ok");
+  return ret;
+}
+
+/* the kernel must be bit exact with the reference for any length */
+static int bench_checksum(const uint8_t *data, uint32_t len, int loops) {
+  uint64_t t_ref = 0, t_ref64 = 0, t_calc = 0, t0;
+  unsigned short ref, ref64, ecc, ecc64;
+  uint32_t n;
+  int i;
+
+  for (n = len - 3; n <= len; n++) {
+    nv_checksum_calc(data, n, &ecc, &ecc64);
+    if (ecc != calc_Checksum((unsigned char *)data, n) ||
+        ecc64 != calc_Checksum64((unsigned char *)data, n)) {
+      fprintf(stderr, "checksum mismatch at len %u\n", n);
+      return -1;
+    }
+  }
+
+  for (i = 0; i < loops; i++) {
+    t0 = now_ns();
+    ref = calc_Checksum((unsigned char *)data, len);
+    t_ref += now_ns() - t0;
+
+    t0 = now_ns();
+    ref64 = calc_Checksum64((unsigned char *)data, len);
+    t_ref64 += now_ns() - t0;
+
+    t0 = now_ns();
+    nv_checksum_calc(data, len, &ecc, &ecc64);
+    t_calc += now_ns() - t0;
+
+    if (ref != ecc || ref64 != ecc64)
+      return -1;
+  }
+
+  printf("  checksum %5uKB  calc_Checksum %8.1fMB/s  calc_Checksum64 %8.1fMB/s"
+         "  nv_checksum_calc(both) %8.1fMB/s\n", len / 1024,
+         mb_per_s((uint64_t)len * loops, t_ref),
+         mb_per_s((uint64_t)len * loops, t_ref64),
+         mb_per_s((uint64_t)len * loops, t_calc));
+  return 0;
+}
+
+static int bench_read(const char *dir, const uint8_t *data, uint32_t len,
+                      int loops) {
+  char org[NV_BENCH_PATH_LEN], bak[NV_BENCH_PATH_LEN], out[NV_BENCH_PATH_LEN];
+  uint64_t t, t0;
+  int layout, i, ret;
+
+  snprintf(org, sizeof(org), "%s/nv_bench_org", dir);
+  snprintf(bak, sizeof(bak), "%s/nv_bench_bak", dir);
+  snprintf(out, sizeof(out), "%s/nv_bench_out", dir);
+
+  for (layout = 0; layout < NV_LAYOUT_NUM; layout++) {
+    t = 0;
+    for (i = 0; i < loops; i++) {
+      /* the repair rewrites the damaged copy, generate it again */
+      if (make_partition(org, bak, out, data, len, layout))
+        return -1;
+
+      t0 = now_ns();
+      ret = read_nv_partition(org, bak, out);
+      t += now_ns() - t0;
+
+      if (layout == NV_LAYOUT_DOUBLE ? ret != 0
+                                     : (ret != 1 || !check_output(out, data, len))) {
+        fprintf(stderr, "read_nv_partition %s %uKB: wrong result %d\n",
+                layout_name[layout], len / 1024, ret);
+        return -1;
+      }
+    }
+
+    printf("  read     %5uKB  %-15s %8.1fMB/s  %8.3fms\n", len / 1024,
+           layout_name[layout], mb_per_s((uint64_t)len * loops, t),
+           t / 1e6 / loops);
+  }
+
+  unlink(org);
+  unlink(bak);
+  unlink(out);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = "/tmp";
+  int loops = NV_BENCH_LOOPS;
+  uint8_t *data;
+  uint32_t max_len = bench_size[sizeof(bench_size) / sizeof(bench_size[0]) - 1];
+  size_t i;
+  int opt, ret = 0;
+
+  while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'n':
+        loops = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-d dir] [-n loops]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (loops <= 0)
+    loops = NV_BENCH_LOOPS;
+
+  data = malloc(max_len);
+  if (NULL == data)
+    return 1;
+  fill_random(data, max_len, 0x4e56);
+
+  printf("nv bench: dir=%s loops=%d\n", dir, loops);
+  if (bench_verify(data, max_len))
+    ret = 1;
+  for (i = 0; i < sizeof(bench_size) / sizeof(bench_size[0]) && !ret; i++) {
+    if (bench_checksum(data, bench_size[i], loops) ||
+        bench_read(dir, data, bench_size[i], loops)) {
+      ret = 1;
+      break;
+    }
+  }
+
+  free(data);
+  printf("nv bench: %s\n", ret ? "FAILED" : "done");
+  return ret;
+}
@@ -0,0 +1,256 @@
+/*
+ *  nv_checksum.c - nv partition checksum and compare.
+ *
+ *  calc_Checksum and calc_Checksum64 add the same little endian
+ *  16bit words, they only differ in the width of the sum, so both
+ *  can be got from one 64bit sum:
+ *    sum = sum(even bytes) + (sum(odd bytes) << 8)
+ *  the 32bit one wraps as the 32bit accumulator does.
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#include <string.h>
+
+/*
+ * the x86 kernels are built with target attributes, so every one the
+ * cpu can run is there for nv_checksum_kernels(), the build flags only
+ * pick the one nv_checksum_sum() uses.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NV_CHECKSUM_X86
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) \
+      && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#include <arm_neon.h>
+#define NV_CHECKSUM_NEON
+#endif
+
+#include "nv_checksum.h"
+
+static uint64_t nv_checksum_sum_scalar(const unsigned char *dat,
+                                       unsigned long len) {
+  uint64_t lo = 0, hi = 0;
+
+  while (len >= 8) {
+    lo += dat[0] + dat[2] + dat[4] + dat[6];
+    hi += dat[1] + dat[3] + dat[5] + dat[7];
+    dat += 8;
+    len -= 8;
+  }
+
+  while (len > 1) {
+    lo += dat[0];
+    hi += dat[1];
+    dat += 2;
+    len -= 2;
+  }
+
+  if (len)
+    lo += *dat;
+
+  return lo + (hi << 8);
+}
+
+#ifdef NV_CHECKSUM_X86
+__attribute__((target("avx2")))
+static uint64_t nv_checksum_sum_avx2(const unsigned char *dat,
+                                     unsigned long len) {
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo = zero, hi = zero, v;
+  uint64_t l[4], h[4];
+
+  while (len >= 32) {
+    v = _mm256_loadu_si256((const __m256i *)dat);
+    lo = _mm256_add_epi64(lo, _mm256_sad_epu8(_mm256_and_si256(v, mask), zero));
+    hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_srli_epi16(v, 8), zero));
+    dat += 32;
+    len -= 32;
+  }
+
+  _mm256_storeu_si256((__m256i *)l, lo);
+  _mm256_storeu_si256((__m256i *)h, hi);
+  /* whole vectors consumed, the tail starts at an even offset */
+  return (l[0] + l[1] + l[2] + l[3]) + ((h[0] + h[1] + h[2] + h[3]) << 8) +
+         nv_checksum_sum_scalar(dat, len);
+}
+
+__attribute__((target("sse2")))
+static uint64_t nv_checksum_sum_sse2(const unsigned char *dat,
+                                     unsigned long len) {
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = zero, hi = zero, v;
+  uint64_t l[2], h[2];
+
+  while (len >= 16) {
+    v = _mm_loadu_si128((const __m128i *)dat);
+    lo = _mm_add_epi64(lo, _mm_sad_epu8(_mm_and_si128(v, mask), zero));
+    hi = _mm_add_epi64(hi, _mm_sad_epu8(_mm_srli_epi16(v, 8), zero));
+    dat += 16;
+    len -= 16;
+  }
+
+  _mm_storeu_si128((__m128i *)l, lo);
+  _mm_storeu_si128((__m128i *)h, hi);
+  return (l[0] + l[1]) + ((h[0] + h[1]) << 8) +
+         nv_checksum_sum_scalar(dat, len);
+}
+#endif
+
+#ifdef NV_CHECKSUM_NEON
+/* a 32bit lane gets 2 words every load, flush to 64bit before overflow */
+#define NV_NEON_BLOCK 16384
+
+static uint64_t nv_checksum_sum_neon(const unsigned char *dat,
+                                     unsigned long len) {
+  uint64x2_t acc = vdupq_n_u64(0);
+  uint32x4_t acc32;
+  unsigned long n;
+
+  while (len >= 16) {
+    acc32 = vdupq_n_u32(0);
+    n = len / 16;
+    if (n > NV_NEON_BLOCK)
+      n = NV_NEON_BLOCK;
+    len -= n * 16;
+
+    while (n--) {
+      acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(vld1q_u8(dat)));
+      dat += 16;
+    }
+    acc = vpadalq_u32(acc, acc32);
+  }
+
+  return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) +
+         nv_checksum_sum_scalar(dat, len);
+}
+#endif
+
+uint64_t nv_checksum_sum(const unsigned char *dat, unsigned long len) {
+#if defined(__AVX2__)
+  return nv_checksum_sum_avx2(dat, len);
+#elif defined(__SSE2__)
+  return nv_checksum_sum_sse2(dat, len);
+#elif defined(NV_CHECKSUM_NEON)
+  return nv_checksum_sum_neon(dat, len);
+#else
+  return nv_checksum_sum_scalar(dat, len);
+#endif
+}
+
+int nv_checksum_kernels(nv_checksum_kernel_t *kernels, int max) {
+  int n = 0;
+
+  if (n < max) {
+    kernels[n].name = "scalar";
+    kernels[n++].sum = nv_checksum_sum_scalar;
+  }
+#ifdef NV_CHECKSUM_X86
+  __builtin_cpu_init();
+  if (n < max && __builtin_cpu_supports("sse2")) {
+    kernels[n].name = "sse2";
+    kernels[n++].sum = nv_checksum_sum_sse2;
+  }
+  if (n < max && __builtin_cpu_supports("avx2")) {
+    kernels[n].name = "avx2";
+    kernels[n++].sum = nv_checksum_sum_avx2;
+  }
+#endif
+#ifdef NV_CHECKSUM_NEON
+  if (n < max) {
+    kernels[n].name = "neon";
+    kernels[n++].sum = nv_checksum_sum_neon;
+  }
+#endif
+
+  return n;
+}
+
+unsigned short nv_checksum_fold32(uint64_t sum) {
+  uint32_t chkSum = (uint32_t)sum;
+
+  chkSum = (chkSum >> 16) + (chkSum & 0xffff);
+  chkSum += (chkSum >> 16);
+  return (~chkSum);
+}
+
+unsigned short nv_checksum_fold64(uint64_t sum) {
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum += (sum >> 16);
+  return (~sum);
+}
+
+void nv_checksum_calc(const unsigned char *dat, unsigned long len,
+                      unsigned short *ecc, unsigned short *ecc64) {
+  uint64_t sum = nv_checksum_sum(dat, len);
+
+  *ecc = nv_checksum_fold32(sum);
+  *ecc64 = nv_checksum_fold64(sum);
+}
+
+/* no early exit in a block, xor the whole block and test once */
+int nv_block_equal(const unsigned char *a, const unsigned char *b,
+                   unsigned long len) {
+  unsigned char diff = 0;
+
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+
+  while (len >= 32) {
+    acc = _mm256_or_si256(acc, _mm256_xor_si256(
+        _mm256_loadu_si256((const __m256i *)a),
+        _mm256_loadu_si256((const __m256i *)b)));
+    a += 32;
+    b += 32;
+    len -= 32;
+  }
+  if (!_mm256_testz_si256(acc, acc))
+    return 0;
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+
+  while (len >= 16) {
+    acc = _mm_or_si128(acc, _mm_xor_si128(
+        _mm_loadu_si128((const __m128i *)a),
+        _mm_loadu_si128((const __m128i *)b)));
+    a += 16;
+    b += 16;
+    len -= 16;
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+    return 0;
+#elif defined(NV_CHECKSUM_NEON)
+  uint8x16_t acc = vdupq_n_u8(0);
+  uint64x2_t acc64;
+
+  while (len >= 16) {
+    acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a), vld1q_u8(b)));
+    a += 16;
+    b += 16;
+    len -= 16;
+  }
+  acc64 = vreinterpretq_u64_u8(acc);
+  if (vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1))
+    return 0;
+#else
+  uint64_t x, y, acc = 0;
+
+  while (len >= 8) {
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    acc |= x ^ y;
+    a += 8;
+    b += 8;
+    len -= 8;
+  }
+  if (acc)
+    return 0;
+#endif
+
+  while (len--)
+    diff |= *a++ ^ *b++;
+
+  return diff == 0;
+}
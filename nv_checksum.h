@@ -0,0 +1,41 @@
+/*
+ *  nv_checksum.h - nv partition checksum and compare.
+ *
+ *
+ *  Copyright (C) 2019 spreadtrum Communications Inc.
+ *
+ */
+#ifndef _NV_CHECKSUM_H
+#define _NV_CHECKSUM_H
+
+#include <stdint.h>
+
+/*
+ * sum of the little endian 16bit words of dat,
+ * an odd tail byte is added as the low byte.
+ * the sum of a buffer split at even offsets is the sum of the parts.
+ */
+uint64_t nv_checksum_sum(const unsigned char *dat, unsigned long len);
+
+/* a sum kernel built in, for checking them against the reference */
+typedef struct {
+  const char *name;
+  uint64_t (*sum)(const unsigned char *dat, unsigned long len);
+} nv_checksum_kernel_t;
+
+/* fills the kernels this cpu can run, returns how many */
+int nv_checksum_kernels(nv_checksum_kernel_t *kernels, int max);
+
+/* fold the sum as calc_Checksum(32bit sum) and calc_Checksum64 do */
+unsigned short nv_checksum_fold32(uint64_t sum);
+unsigned short nv_checksum_fold64(uint64_t sum);
+
+/* both checksums in one pass */
+void nv_checksum_calc(const unsigned char *dat, unsigned long len,
+                      unsigned short *ecc, unsigned short *ecc64);
+
+/* 1 if the two blocks are the same */
+int nv_block_equal(const unsigned char *a, const unsigned char *b,
+                   unsigned long len);
+
+#endif /* _NV_CHECKSUM_H */
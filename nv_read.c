@@ -26,6 +26,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <modem_control.h>
+#include "nv_checksum.h"
+#include "nv_read.h"
 
 #define NV_READ_DEBUG
 #ifdef NV_READ_DEBUG
@@ -60,7 +62,57 @@ typedef struct _NV_HEADER {
   uint32 version;
 } nv_header_t;
 
+#define NV_PATH_LEN 128
+/* damaged copy is repaired by blocks, only the differing blocks are written */
+#define NV_REPAIR_BLOCK 4096
+/* nv is streamed by chunks, the memory doesn't depend on the nv size */
+#define NV_CHUNK_SIZE (64 * 1024)
+/* a larger len in header is treated as corrupted */
+#define NV_MAX_LEN (16 * 1024 * 1024)
+
+/* one copy of the nv partition */
+typedef struct _NV_IMAGE {
+  char *path;
+  int handle;
+  char header[RAMNV_SECT_SIZE];
+  int32 size;
+  int usable;  /* opened and header read */
+  int valid;
+  pthread_t tid;
+  int running;
+} nv_image_t;
+
+struct nv_partition {
+  char path[NV_PATH_LEN + 1];
+  char Bak_path[NV_PATH_LEN + 1];
+  nv_image_t org;
+  nv_image_t bak;
+  int use_shadow;  /* keep the output as shadow */
+  int shadow_hit;  /* output the shadow, the copies are not checked */
+};
+
+/*
+ * the verified output of a partition (fixnv), tagged with the headers
+ * of both copies and the repair generation when it's taken.
+ */
+typedef struct _NV_SHADOW {
+  char path[NV_PATH_LEN + 1];
+  char Bak_path[NV_PATH_LEN + 1];
+  char header[RAMNV_SECT_SIZE];
+  char Bak_header[RAMNV_SECT_SIZE];
+  uint8 *data;
+  int32 size;
+  uint32 gen;
+} nv_shadow_t;
+
+static pthread_mutex_t nv_shadow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static nv_shadow_t nv_shadow;
+/* increased every time the daemon writes a nv partition */
+static volatile uint32 nv_repair_gen;
+
 char argv1[10];
+
+/* reference checksums, nv_checksum_calc gets both of them in one pass */
 unsigned short calc_Checksum(unsigned char *dat, unsigned long len) {
   unsigned short num = 0;
   uint32_t chkSum = 0;
@@ -99,106 +151,430 @@ unsigned short calc_Checksum64(unsigned char *dat, unsigned long len) {
   return (~chkSum);
 }
 
-int read_nv_partition(char *path, char *Bak_path, char *path_out) {
-  int handle = 0, Bak_Handle = 0, out_handle;
-  char header[RAMNV_SECT_SIZE], Bak_header[RAMNV_SECT_SIZE];
-  nv_header_t *header_ptr = NULL, *Bak_header_ptr = NULL;
-  int32 ret, ret1, ret2, size;
-  int32 status = 0;
-  int32 Bak_size = 0;
-  uint8 *buf = NULL;
-  uint8 * Bak_buf = NULL;
+/* read len bytes unless eof or error, return the read bytes */
+static int32 nv_pread(int fd, uint8 *buf, int32 len, int32 off) {
+  int32 n, done = 0;
+
+  while (done < len) {
+    n = pread(fd, buf + done, len - done, off + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+
+  return done;
+}
+
+static int32 nv_write(int fd, const uint8 *buf, int32 len) {
+  int32 n, done = 0;
+
+  while (done < len) {
+    n = write(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+
+  return done;
+}
+
+/* chunk of [pos, size) in data area, the chunks are aligned to partition */
+static int32 nv_chunk_len(int32 pos, int32 size) {
+  int32 n = NV_CHUNK_SIZE - (RAMNV_SECT_SIZE + pos) % NV_CHUNK_SIZE;
+
+  return n < size - pos ? n : size - pos;
+}
+
+/* read and check one copy by chunks, run in its own thread */
+static void *nv_image_validate(void *arg) {
+  nv_image_t *img = (nv_image_t *)arg;
+  nv_header_t *header_ptr = (nv_header_t *)img->header;
   unsigned short ecc;
   unsigned short ecc64;
-  BOOLEAN result;
+  uint64_t sum = 0;
+  off_t part_size;
+  int32 pos, n;
+  uint8 *buf;
 
-  header_ptr = (nv_header_t *)header;
-  Bak_header_ptr = (nv_header_t *)Bak_header;
-  MODEM_LOGD(" %s path=%s, bak_path=%s, out=%s\n", __func__, path, Bak_path,
-             path_out);
-  do {
-    handle =
-        open(path, O_RDWR);
-    if (handle < 0)
-      return 0;
+  img->handle = open(img->path, O_RDWR);
+  if (img->handle < 0)
+    return NULL;
 
-    ret1 = read(handle, header, RAMNV_SECT_SIZE);
-    if (ret1 != RAMNV_SECT_SIZE) break;
-    size = header_ptr->len;
-    buf = malloc(size);
-    if (NULL == buf) {
-      close(handle);
-      return 0;
+  if (RAMNV_SECT_SIZE != nv_pread(img->handle, (uint8 *)img->header,
+                                  RAMNV_SECT_SIZE, 0))
+    return NULL;
+  img->usable = 1;
+
+  /* don't trust len, it must fit in the partition */
+  part_size = lseek(img->handle, 0, SEEK_END);
+  if (header_ptr->len > NV_MAX_LEN ||
+      (part_size > 0 && header_ptr->len > part_size - RAMNV_SECT_SIZE)) {
+    MODEM_LOGD("%s len 0x%x is invalid, partition size 0x%lx\n", img->path,
+               header_ptr->len, (unsigned long)part_size);
+    return NULL;
+  }
+  img->size = header_ptr->len;
+
+  /* couldn't check isn't corrupt, a copy only unusable isn't repaired */
+  buf = malloc(NV_CHUNK_SIZE);
+  if (NULL == buf) {
+    img->usable = 0;
+    return NULL;
+  }
+
+  /* the chunks have even length, so the sums can be added */
+  for (pos = 0; pos < img->size; pos += n) {
+    n = nv_chunk_len(pos, img->size);
+    if (n != nv_pread(img->handle, buf, n, RAMNV_SECT_SIZE + pos)) {
+      MODEM_LOGD("%s read 0x%x at 0x%x failed\n", img->path, n, pos);
+      free(buf);
+      img->usable = 0;
+      return NULL;
     }
-    memset(buf, 0, size);
-    ret2 = read(handle, buf, size);
-    if (ret2 != size) break;
-    ecc = calc_Checksum(buf, size);
-    ecc64 = calc_Checksum64(buf, size);
-    if (header_ptr->magic == MAGIC && ((ecc == header_ptr->checksum) || (ecc64 == header_ptr->checksum))) {
-      status += 1;
+    sum += nv_checksum_sum(buf, n);
+  }
+  free(buf);
+
+  ecc = nv_checksum_fold32(sum);
+  ecc64 = nv_checksum_fold64(sum);
+  if (header_ptr->magic == MAGIC &&
+      ((ecc == header_ptr->checksum) || (ecc64 == header_ptr->checksum))) {
+    img->valid = 1;
+  } else {
+    MODEM_LOGD("%s calc_Checksum fail,magic=0x%0x,checksum=0x%0x,ecc=0x%0x\n",
+               img->path, header_ptr->magic, header_ptr->checksum, ecc);
+  }
+
+  return NULL;
+}
+
+static void nv_image_start(nv_image_t *img, char *path) {
+  img->path = path;
+  img->handle = -1;
+  img->size = 0;
+  img->usable = 0;
+  img->valid = 0;
+
+  img->running = (0 == pthread_create(&img->tid, NULL,
+                                      nv_image_validate, img));
+  if (!img->running)
+    nv_image_validate(img);
+}
+
+static void nv_image_wait(nv_image_t *img) {
+  if (img->running) {
+    pthread_join(img->tid, NULL);
+    img->running = 0;
+  }
+}
+
+static void nv_image_release(nv_image_t *img) {
+  nv_image_wait(img);
+  if (img->handle >= 0)
+    close(img->handle);
+  img->handle = -1;
+}
+
+/*
+ * write good to fd at off, but skip the blocks which are the same
+ * as the old content(old_len bytes), return the written bytes.
+ */
+static int32 nv_repair_blocks(int fd, int32 off, const uint8 *good, int32 len,
+                              const uint8 *old, int32 old_len) {
+  int32 pos, n, written = 0;
+
+  for (pos = 0; pos < len; pos += n) {
+    /* keep the blocks aligned to the partition */
+    n = NV_REPAIR_BLOCK - (off + pos) % NV_REPAIR_BLOCK;
+    if (n > len - pos)
+      n = len - pos;
+
+    if (pos + n <= old_len && nv_block_equal(good + pos, old + pos, n))
+      continue;
+
+    if (n != pwrite(fd, good + pos, n, off + pos))
+      return -1;
+    written += n;
+  }
+
+  return written;
+}
+
+/* make the damaged copy dst the same as src, chunk by chunk */
+static int32 nv_image_repair(nv_image_t *dst, nv_image_t *src) {
+  int32 pos, n, w, old_len, written;
+  uint8 *sbuf, *dbuf;
+
+  written = nv_repair_blocks(dst->handle, 0, (uint8 *)src->header,
+                             RAMNV_SECT_SIZE, (uint8 *)dst->header,
+                             RAMNV_SECT_SIZE);
+  if (written < 0) {
+    __sync_add_and_fetch(&nv_repair_gen, 1);
+    return -1;
+  }
+
+  sbuf = malloc(NV_CHUNK_SIZE);
+  dbuf = malloc(NV_CHUNK_SIZE);
+  if (NULL == sbuf || NULL == dbuf) {
+    free(sbuf);
+    free(dbuf);
+    return -1;
+  }
+
+  for (pos = 0; pos < src->size; pos += n) {
+    n = nv_chunk_len(pos, src->size);
+    if (n != nv_pread(src->handle, sbuf, n, RAMNV_SECT_SIZE + pos)) {
+      written = -1;
+      break;
     }
-    else{
-      MODEM_LOGD("calc_Checksum fail,header_ptr->magic=0x%0x,aheader_ptr->checksum=0x%0x,ecc=0x%0x\n",
-		  header_ptr->magic, header_ptr->checksum, ecc);
+
+    old_len = nv_pread(dst->handle, dbuf, n, RAMNV_SECT_SIZE + pos);
+    w = nv_repair_blocks(dst->handle, RAMNV_SECT_SIZE + pos, sbuf, n,
+                         dbuf, old_len);
+    if (w < 0) {
+      written = -1;
+      break;
     }
-  } while (0);
+    written += w;
+  }
 
-  if (NULL == buf) {
-    close(handle);
+  free(sbuf);
+  free(dbuf);
+  __sync_add_and_fetch(&nv_repair_gen, 1);
+  if (written < 0)
+    return -1;
+
+  NVREAD("%s repaired from %s, %d bytes written\n", dst->path, src->path,
+         written);
+  return written;
+}
+
+/*
+ * stream the data of the valid copy to out, and to copy if it's not NULL,
+ * return the written bytes.
+ */
+static int32 nv_image_output(nv_image_t *img, int out_handle, uint8 *copy) {
+  int32 pos, n, written = 0;
+  uint8 *buf;
+
+  buf = malloc(NV_CHUNK_SIZE);
+  if (NULL == buf)
+    return -1;
+
+  for (pos = 0; pos < img->size; pos += n) {
+    n = nv_chunk_len(pos, img->size);
+    if (n != nv_pread(img->handle, buf, n, RAMNV_SECT_SIZE + pos))
+      break;
+    if (n != nv_write(out_handle, buf, n)) {
+      NVREAD("%s write nv failed %s!\n", __func__, strerror(errno));
+      break;
+    }
+    if (copy)
+      memcpy(copy + pos, buf, n);
+    written += n;
+  }
+
+  free(buf);
+  return written;
+}
+
+static int nv_read_header(char *path, char *header) {
+  int fd, ret;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ret = nv_pread(fd, (uint8 *)header, RAMNV_SECT_SIZE, 0);
+  close(fd);
+  return ret == RAMNV_SECT_SIZE ? 0 : -1;
+}
+
+/* the shadow is still valid if no header on flash has changed */
+static int nv_shadow_match(nv_partition_t *nv) {
+  char header[RAMNV_SECT_SIZE], Bak_header[RAMNV_SECT_SIZE];
+  int match;
+
+  if (nv_read_header(nv->path, header) ||
+      nv_read_header(nv->Bak_path, Bak_header))
     return 0;
+
+  pthread_mutex_lock(&nv_shadow_mutex);
+  match = nv_shadow.data != NULL &&
+          nv_shadow.gen == nv_repair_gen &&
+          !strcmp(nv_shadow.path, nv->path) &&
+          !strcmp(nv_shadow.Bak_path, nv->Bak_path) &&
+          !memcmp(nv_shadow.header, header, RAMNV_SECT_SIZE) &&
+          !memcmp(nv_shadow.Bak_header, Bak_header, RAMNV_SECT_SIZE);
+  pthread_mutex_unlock(&nv_shadow_mutex);
+
+  return match;
+}
+
+/* take data as the new shadow, tag it with the headers after repair */
+static void nv_shadow_update(nv_partition_t *nv, uint8 *data, int32 size) {
+  char header[RAMNV_SECT_SIZE], Bak_header[RAMNV_SECT_SIZE];
+  uint32 gen = nv_repair_gen;
+
+  if (nv_read_header(nv->path, header) ||
+      nv_read_header(nv->Bak_path, Bak_header)) {
+    free(data);
+    return;
   }
-  lseek(handle, 0, SEEK_SET);
 
-  do {
-    Bak_Handle = open(Bak_path, O_RDWR);
+  pthread_mutex_lock(&nv_shadow_mutex);
+  free(nv_shadow.data);
+  snprintf(nv_shadow.path, sizeof(nv_shadow.path), "%s", nv->path);
+  snprintf(nv_shadow.Bak_path, sizeof(nv_shadow.Bak_path), "%s", nv->Bak_path);
+  memcpy(nv_shadow.header, header, RAMNV_SECT_SIZE);
+  memcpy(nv_shadow.Bak_header, Bak_header, RAMNV_SECT_SIZE);
+  nv_shadow.data = data;
+  nv_shadow.size = size;
+  nv_shadow.gen = gen;
+  pthread_mutex_unlock(&nv_shadow_mutex);
 
-    if (Bak_Handle < 0) {
-      close(handle);
-      free(buf);
-      return 0;
-    }
+  MODEM_LOGD("%s: %s shadow size 0x%x, gen %u\n", __func__, nv->path,
+             size, gen);
+}
 
-    ret1 = read(Bak_Handle, Bak_header, RAMNV_SECT_SIZE);
-    if (ret1 != RAMNV_SECT_SIZE) break;
-    Bak_size = Bak_header_ptr->len;
-    Bak_buf = malloc(Bak_size);
-    if (0 == Bak_buf) {
-      close(handle);
-      close(Bak_Handle);
-      free(buf);
+static int nv_shadow_output(nv_partition_t *nv, int out_handle) {
+  int32 written;
+
+  pthread_mutex_lock(&nv_shadow_mutex);
+  written = nv_write(out_handle, nv_shadow.data, nv_shadow.size);
+  NVREAD("%s output from shadow, gen %u, 0x%x/0x%x bytes\n", nv->path,
+         nv_shadow.gen, written, nv_shadow.size);
+  written = (written == nv_shadow.size);
+  pthread_mutex_unlock(&nv_shadow_mutex);
+
+  return written;
+}
+
+static nv_partition_t *nv_partition_alloc(char *path, char *Bak_path) {
+  nv_partition_t *nv;
+
+  MODEM_LOGD(" %s path=%s, bak_path=%s\n", __func__, path, Bak_path);
+
+  nv = malloc(sizeof(nv_partition_t));
+  if (NULL == nv)
+    return NULL;
+
+  memset(nv, 0, sizeof(nv_partition_t));
+  snprintf(nv->path, sizeof(nv->path), "%s", path);
+  snprintf(nv->Bak_path, sizeof(nv->Bak_path), "%s", Bak_path);
+  nv->org.handle = -1;
+  nv->bak.handle = -1;
+
+  return nv;
+}
+
+/* check the org and bak copy concurrently */
+nv_partition_t *nv_partition_validate(char *path, char *Bak_path) {
+  nv_partition_t *nv = nv_partition_alloc(path, Bak_path);
+
+  if (NULL == nv)
+    return NULL;
+
+  nv_image_start(&nv->org, nv->path);
+  nv_image_start(&nv->bak, nv->Bak_path);
+
+  return nv;
+}
+
+/*
+ * as nv_partition_validate, but the copies are checked only if
+ * the headers on flash differ from the shadow, then the output is
+ * kept as the new shadow.
+ */
+nv_partition_t *nv_partition_validate_shadow(char *path, char *Bak_path) {
+  nv_partition_t *nv = nv_partition_alloc(path, Bak_path);
+
+  if (NULL == nv)
+    return NULL;
+
+  nv->use_shadow = 1;
+  if (nv_shadow_match(nv)) {
+    nv->shadow_hit = 1;
+    return nv;
+  }
+
+  nv_image_start(&nv->org, nv->path);
+  nv_image_start(&nv->bak, nv->Bak_path);
+
+  return nv;
+}
+
+void nv_partition_release(nv_partition_t *nv) {
+  if (NULL == nv)
+    return;
+
+  nv_image_release(&nv->org);
+  nv_image_release(&nv->bak);
+  free(nv);
+}
+
+/* wait the check result, repair the damaged copy and output nv */
+int nv_partition_commit(nv_partition_t *nv, char *path_out) {
+  int out_handle;
+  int32 ret, size, Bak_size;
+  int32 status = 0;
+  uint8 *copy = NULL;
+  BOOLEAN result;
+  char *path;
+
+  if (NULL == nv)
+    return 0;
+
+  if (nv->shadow_hit) {
+    out_handle = open(path_out, O_RDWR);
+    if (out_handle < 0) {
+      nv_partition_release(nv);
       return 0;
     }
-    memset(Bak_buf, 0, Bak_size);
-    ret2 = read(Bak_Handle, Bak_buf, Bak_size);
-    if (ret2 != Bak_size) break;
-    ecc = calc_Checksum(Bak_buf, Bak_size);
-    ecc64 = calc_Checksum64(Bak_buf, Bak_size);
-    if (Bak_header_ptr->magic == MAGIC && ((ecc == Bak_header_ptr->checksum) || (ecc64 == Bak_header_ptr->checksum))) {
-      status += 1 << 1;
-    }
-    else{
-      MODEM_LOGD("bakcalc_Checksum fail,Bak_header_ptr->magic=0x%0x,bak_header_ptr->checksum=0x%0x,ecc=0x%0x\n",
-		  Bak_header_ptr->magic, Bak_header_ptr->checksum, ecc);
-    }
-  } while (0);
+    modem_ctrl_enable_busmonitor(0);
+    modem_ctrl_enable_dmc_mpu(0);
+    result = nv_shadow_output(nv, out_handle);
+    modem_ctrl_enable_busmonitor(1);
+    modem_ctrl_enable_dmc_mpu(1);
+    close(out_handle);
+    nv_partition_release(nv);
+    return result;
+  }
+
+  nv_image_wait(&nv->org);
+  nv_image_wait(&nv->bak);
+
+  MODEM_LOGD(" %s path=%s, bak_path=%s, out=%s\n", __func__, nv->path,
+             nv->Bak_path, path_out);
 
-  if (NULL == Bak_buf) {
-    close(handle);
-    close(Bak_Handle);
-    free(buf);
+  /* can't read any of the copies, don't output */
+  if (!nv->org.usable || !nv->bak.usable) {
+    nv_partition_release(nv);
     return 0;
   }
-  lseek(Bak_Handle, 0, SEEK_SET);
+
+  path = nv->path;
+  size = nv->org.size;
+  Bak_size = nv->bak.size;
+  if (nv->org.valid)
+    status += 1;
+  if (nv->bak.valid)
+    status += 1 << 1;
 
   out_handle = open(path_out, O_RDWR);
   if (out_handle < 0) {
-    close(handle);
-    close(Bak_Handle);
-    free(buf);
-    free(Bak_buf);
+    nv_partition_release(nv);
     return 0;
   }
+
+  /* the output copy will be the shadow */
+  if (nv->use_shadow && status)
+    copy = malloc(status == 2 ? Bak_size : size);
+
   modem_ctrl_enable_busmonitor(0);
   modem_ctrl_enable_dmc_mpu(0);
   switch (status) {
@@ -216,11 +592,10 @@ int read_nv_partition(char *path, char *Bak_path, char *path_out) {
       break;
     case 1:
       NVREAD("bak partition is damaged!\n");
-      if (RAMNV_SECT_SIZE != write(Bak_Handle, header, RAMNV_SECT_SIZE) ||
-          size != write(Bak_Handle, buf, size)) {
+      if (nv_image_repair(&nv->bak, &nv->org) < 0) {
         NVREAD("write backup partition error\n");
       }
-      if (size != write(out_handle, buf, size)) {
+      if (size != nv_image_output(&nv->org, out_handle, copy)) {
         result = 0;
         break;
       }
@@ -228,18 +603,17 @@ int read_nv_partition(char *path, char *Bak_path, char *path_out) {
       break;
     case 2:
       NVREAD("org partition is damaged!\n!");
-      if (RAMNV_SECT_SIZE != write(handle, Bak_header, RAMNV_SECT_SIZE) ||
-          Bak_size != write(handle, Bak_buf, Bak_size)) {
+      if (nv_image_repair(&nv->org, &nv->bak) < 0) {
         NVREAD("write org partition error\n");
       }
-      if (Bak_size != write(out_handle, Bak_buf, Bak_size)) {
+      if (Bak_size != nv_image_output(&nv->bak, out_handle, copy)) {
         result = 0;
         break;
       }
       result = 1;
       break;
     case 3:
-      if (size != write(out_handle, buf, size)) {
+      if (size != nv_image_output(&nv->org, out_handle, copy)) {
         NVREAD("%s write nv partition failed %s!\n", __func__, strerror(errno));
         result = 0;
         break;
@@ -255,10 +629,19 @@ int read_nv_partition(char *path, char *Bak_path, char *path_out) {
   }
   modem_ctrl_enable_busmonitor(1);
   modem_ctrl_enable_dmc_mpu(1);
-  close(handle);
-  close(Bak_Handle);
   close(out_handle);
-  free(buf);
-  free(Bak_buf);
+  nv_image_release(&nv->org);
+  nv_image_release(&nv->bak);
+
+  if (copy && result)
+    nv_shadow_update(nv, copy, status == 2 ? Bak_size : size);
+  else
+    free(copy);
+
+  nv_partition_release(nv);
   return result;
 }
+
+int read_nv_partition(char *path, char *Bak_path, char *path_out) {
+  return nv_partition_commit(nv_partition_validate(path, Bak_path), path_out);
+}
@@ -7,5 +7,22 @@
 #ifndef NV_READ_H_
 #define NV_READ_H_
 
+typedef struct nv_partition nv_partition_t;
+
 int read_nv_partition(char* path, char* Bak_path, char* path_out);
+
+/* reference checksums of the nv data, with 32bit and 64bit sum */
+unsigned short calc_Checksum(unsigned char *dat, unsigned long len);
+unsigned short calc_Checksum64(unsigned char *dat, unsigned long len);
+
+/*
+ * read_nv_partition in two steps, validate starts checking the org
+ * and bak copy in background, commit waits the result, repairs the
+ * damaged copy and writes nv to path_out. release drops an uncommitted one.
+ */
+nv_partition_t *nv_partition_validate(char* path, char* Bak_path);
+/* keep a verified shadow of the output, reuse it if no header changed */
+nv_partition_t *nv_partition_validate_shadow(char* path, char* Bak_path);
+int nv_partition_commit(nv_partition_t *nv, char* path_out);
+void nv_partition_release(nv_partition_t *nv);
 #endif
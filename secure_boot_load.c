@@ -15,7 +15,12 @@
 #define AVB_CERT_SIZE              8192
 
 #if defined(CONFIG_SPRD_SECBOOT) || defined(CONFIG_VBOOT_V2)
+#include <pthread.h>
+
 KBC_LOAD_TABLE_S       kbc_table;
+
+/* images may be loaded concurrently, kbc_table is filled under kbc_mutex */
+static pthread_mutex_t kbc_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 #ifdef SECURE_BOOT_ENABLE
@@ -399,6 +404,16 @@ void secure_boot_init(void) {
 #endif
 }
 
+#if defined(CONFIG_SPRD_SECBOOT) || defined(CONFIG_VBOOT_V2)
+static void secure_boot_lock_table(void) {
+  pthread_mutex_lock(&kbc_mutex);
+}
+
+static void secure_boot_unlock_table(void) {
+  pthread_mutex_unlock(&kbc_mutex);
+}
+#endif
+
 int secure_boot_load_img(IMAGE_LOAD_S *img) {
   unsigned int load_offset = 0;
   size_t load_size = 0;
@@ -410,6 +425,7 @@ int secure_boot_load_img(IMAGE_LOAD_S *img) {
   MODEM_LOGD("[secure]verify done.");
 #else
 #if defined(CONFIG_SPRD_SECBOOT)
+  secure_boot_lock_table();
   // Get image header info(size, total size, packed flag)
   uint32_t mImgsize = get_verify_img_info(img->path_r,
                                           &kbc_table.is_packed);
@@ -420,10 +436,12 @@ int secure_boot_load_img(IMAGE_LOAD_S *img) {
   } else {
       MODEM_LOGD("[secure] get_verify_img_info failed!!! \n");
   }
+  secure_boot_unlock_table();
 #else
 #if defined(CONFIG_VBOOT_V2)
   MODEM_LOGD("[secure] run in vboot v2 \n");
   MODEM_LOGD("[secure] load_offset = 0x%x \n", load_offset);
+  secure_boot_lock_table();
   // Get image footer info
   get_image_footer_byname(img->path_w, img->path_r, &kbc_table);
   // fill verify table
@@ -432,6 +450,7 @@ int secure_boot_load_img(IMAGE_LOAD_S *img) {
   if (load_offset > 0) {
       kbc_table.packed_offset = load_offset;
   }
+  secure_boot_unlock_table();
 #endif
 #endif
 #endif